@@ -1,6 +1,17 @@
 [BITS 16]
 [ORG 0x7C00]
 
+KERNEL_SECTORS equ 512
+READ_CHUNK equ 64
+E820_COUNT equ 0x0500
+E820_MAP equ 0x0504
+E820_MAX equ 32
+VBE_STATUS equ 0x1000
+VBE_INFO equ 0x1100
+%ifndef VBE_MODE
+VBE_MODE equ 0x144
+%endif
+
 start:
     cli
     xor ax, ax
@@ -13,30 +24,22 @@ start:
     mov si, msg_load
     call print
 
-    mov ax, 0x2000
-    mov es, ax
-    xor bx, bx
-    mov ah, 0x02
-    mov al, 126
-    mov ch, 0
-    mov cl, 2
-    mov dh, 0
-    mov dl, 0x80
-    int 0x13
-    jc error
+    call detect_memory
 
-    mov ax, 0x2FC0
-    mov es, ax
-    xor bx, bx
-    mov ah, 0x02
-    mov al, 40
-    mov ch, 0
-    mov cl, 2
-    mov dh, 2
+load_loop:
+    mov si, dap
+    mov ah, 0x42
     mov dl, 0x80
     int 0x13
     jc error
-
+    add word [dap_segment], READ_CHUNK * 512 / 16
+    add dword [dap_lba], READ_CHUNK
+    sub word [sectors_left], READ_CHUNK
+    ja load_loop
+
+%ifdef VBE_CONSOLE
+    call set_video_mode
+%endif
     call enable_a20
     call load_gdt
     call enter_protected
@@ -56,6 +59,54 @@ print:
 print_done:
     ret
 
+detect_memory:
+    xor ebx, ebx
+    xor ebp, ebp
+    mov di, E820_MAP
+e820_next:
+    mov eax, 0xE820
+    mov edx, 0x534D4150
+    mov ecx, 24
+    mov dword [di + 20], 1
+    int 0x15
+    jc e820_done
+    cmp eax, 0x534D4150
+    jne e820_done
+    jcxz e820_skip
+    inc bp
+    add di, 24
+    cmp bp, E820_MAX
+    jae e820_done
+e820_skip:
+    test ebx, ebx
+    jnz e820_next
+e820_done:
+    mov [E820_COUNT], ebp
+    ret
+
+%ifdef VBE_CONSOLE
+; Switch to a VBE mode with a linear framebuffer and leave its mode info
+; for the kernel. VBE_STATUS stays 0 if the BIOS refuses.
+set_video_mode:
+    mov dword [VBE_STATUS], 0
+    mov ax, 0x4F01
+    mov cx, VBE_MODE
+    mov di, VBE_INFO
+    int 0x10
+    cmp ax, 0x004F
+    jne vbe_done
+    test byte [VBE_INFO], 0x80
+    jz vbe_done
+    mov ax, 0x4F02
+    mov bx, VBE_MODE | 0x4000
+    int 0x10
+    cmp ax, 0x004F
+    jne vbe_done
+    mov dword [VBE_STATUS], VBE_MODE
+vbe_done:
+    ret
+%endif
+
 enable_a20:
     in al, 0x92
     or al, 2
@@ -89,22 +140,6 @@ setup_l2_cache:
     mov eax, cr0
     and eax, 0x9FFFFFFF
     mov cr0, eax
-    
-    mov ecx, 0x200
-    xor eax, eax
-    xor edx, edx
-    wrmsr
-    
-    mov ecx, 0x201
-    mov eax, 0x06
-    xor edx, edx
-    wrmsr
-    
-    mov eax, cr0
-    or eax, 0x60000000
-    mov cr0, eax
-    
-    wbinvd
     ret
 
 halt:
@@ -121,6 +156,14 @@ gdt_descriptor:
     dw gdt_end - gdt_start - 1
     dd gdt_start
 
+dap:
+    db 0x10, 0
+    dw READ_CHUNK
+    dw 0
+dap_segment dw 0x2000
+dap_lba dq 1
+sectors_left dw KERNEL_SECTORS
+
 msg_load db 'load', 13, 10, 0
 msg_err db 'err', 13, 10, 0
 
@@ -0,0 +1,26 @@
+#ifndef PAGING_H
+#define PAGING_H
+
+#include "types.h"
+
+#define PG_PRESENT 0x001
+#define PG_WRITE 0x002
+#define PG_USER 0x004
+#define PG_PWT 0x008
+#define PG_PCD 0x010
+#define PG_PSE 0x080
+#define PG_GLOBAL 0x100
+
+#define PF_PRESENT 0x01
+#define PF_WRITE 0x02
+
+#define STACK_GUARD (STACK_TOP - STACK_SIZE - 0x1000)
+
+void paging_init(void);
+int paging_set_flags(uintptr_t addr, size_t size, uint32_t set, uint32_t clear);
+int paging_demand_zero(uintptr_t addr, size_t size);
+int paging_handle_fault(uint32_t addr, uint32_t err);
+const char* paging_fault_reason(uint32_t addr, uint32_t err);
+void paging_show_info(void);
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef PMM_H
+#define PMM_H
+
+#include "types.h"
+
+#define PAGE_SIZE 4096
+#define PAGE_SHIFT 12
+#define PMM_MAX_ORDER 10
+
+#define E820_COUNT_ADDR 0x500
+#define E820_MAP_ADDR 0x504
+#define E820_MAX 32
+#define E820_USABLE 1
+
+typedef struct {
+    uint64_t base;
+    uint64_t length;
+    uint32_t type;
+    uint32_t acpi;
+} __attribute__((packed)) e820_entry_t;
+
+/* A pointer to low physical memory that GCC cannot see is a constant, so
+ * it does not warn about reading past a zero-sized object. */
+static inline void* phys_ptr(uintptr_t addr) {
+    __asm__ ("" : "+r"(addr));
+    return (void*)addr;
+}
+
+void pmm_init(void);
+void* pmm_alloc(uint32_t order);
+void pmm_free(void *addr);
+uint32_t pmm_order_for(size_t bytes);
+uint32_t pmm_total_pages(void);
+uint32_t pmm_frame_count(void);
+uint32_t pmm_free_pages(void);
+void pmm_show_info(void);
+void pmm_show_map(void);
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include "types.h"
+#include "spinlock.h"
+#include "smp.h"
+
+#define SCHED_MAX_THREADS 32
+
+/* Lower numbers run first; threads of equal priority share the CPU in
+ * time slices. */
+#define SCHED_PRIO_UI 0
+#define SCHED_PRIO_SHELL 1
+#define SCHED_PRIO_IDLE 2
+#define SCHED_PRIOS 3
+
+#define THREAD_FREE 0
+#define THREAD_READY 1
+#define THREAD_RUNNING 2
+#define THREAD_BLOCKED 3
+#define THREAD_EXITING 4
+
+/* fpu holds the fxsave image and must stay first, for its alignment. */
+typedef struct thread {
+    uint8_t fpu[512];
+    uint32_t esp;
+    struct thread *next;
+    struct thread *wait_next;
+    uint8_t *stack;
+    void (*fn)(void *arg);
+    void *arg;
+    const char *name;
+    uint32_t id;
+    int state;
+    int prio;
+    int screen;
+    uint32_t cpu;
+    int pinned;
+    volatile int wake_pending;
+    int waiting;
+    uint32_t switches;
+    uint64_t cycles;
+    uint32_t *recover;  /* exec_setjmp buffer while running native code */
+} __attribute__((aligned(16))) thread_t;
+
+/* A sleeping lock; waiters block instead of spinning. */
+typedef struct {
+    spinlock_t lock;
+    thread_t *owner;
+    thread_t *waiters;
+} mutex_t;
+
+#define MUTEX_INIT {SPINLOCK_INIT, NULL, NULL}
+
+void sched_init(void);
+uint32_t sched_add_cpu(uint32_t cpu);
+void sched_cpu_start(void) __attribute__((noreturn));
+thread_t* thread_create(const char *name, void (*fn)(void *arg), void *arg, int prio);
+void thread_exit(void);
+thread_t* sched_current(void);
+void sched_yield(void);
+void sched_block(void);
+void sched_wake(thread_t *t);
+void sched_sleep(uint32_t ms);
+void sched_irq_exit(void);
+void sched_preempt_disable(void);
+void sched_preempt_enable(void);
+int sched_stack_guard(uint32_t addr);
+void mutex_lock(mutex_t *m);
+void mutex_unlock(mutex_t *m);
+void sched_show_info(void);
+
+#endif
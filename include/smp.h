@@ -0,0 +1,47 @@
+#ifndef SMP_H
+#define SMP_H
+
+#include "types.h"
+
+#define SMP_MAX_CPUS 8
+#define SMP_RESCHED_VECTOR 50
+#define SMP_TLB_VECTOR 51
+#define SMP_HALT_VECTOR 52
+
+struct thread;
+
+/* Per-CPU data, reached through the CPU's own GS segment. self must stay
+ * first: smp_this_cpu reads it at %gs:0. */
+typedef struct cpu {
+    struct cpu *self;
+    struct thread *current;
+    volatile uint32_t preempt_count;
+    volatile int need_resched;
+    uint32_t id;
+    uint32_t apic_id;
+    volatile int online;
+    uint32_t ipis;
+    uint64_t gdt[4];
+} cpu_t;
+
+static inline cpu_t* smp_this_cpu(void) {
+    cpu_t *cpu;
+    __asm__ volatile ("mov %%gs:0, %0" : "=r"(cpu));
+    return cpu;
+}
+
+static inline uint32_t smp_cpu_id(void) {
+    uint32_t id;
+    __asm__ volatile ("mov %%gs:%c1, %0" : "=r"(id) : "i"(__builtin_offsetof(cpu_t, id)));
+    return id;
+}
+
+void smp_early_init(void);
+void smp_init(void);
+uint32_t smp_cpu_count(void);
+cpu_t* smp_cpu(uint32_t id);
+void smp_send_ipi(uint32_t cpu, uint32_t vector);
+void smp_flush_tlb(uintptr_t start, uintptr_t end);
+void smp_halt_others(void);
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+
+#include "types.h"
+
+/* Ticket lock: a locker takes the next ticket and spins until owner
+ * reaches it, so CPUs get the lock in the order they asked. owner and
+ * next share one word, which lets trylock take a ticket only when the
+ * lock is free. */
+typedef union {
+    volatile uint32_t word;
+    struct {
+        volatile uint16_t owner;
+        volatile uint16_t next;
+    } t;
+} spinlock_t;
+
+#define SPINLOCK_INIT {0}
+
+static inline void ticket_lock(spinlock_t *l) {
+    uint16_t ticket = __atomic_fetch_add(&l->t.next, 1, __ATOMIC_ACQUIRE);
+    while (__atomic_load_n(&l->t.owner, __ATOMIC_ACQUIRE) != ticket)
+        __asm__ volatile ("pause");
+}
+
+static inline int ticket_trylock(spinlock_t *l) {
+    uint32_t owner = __atomic_load_n(&l->t.owner, __ATOMIC_RELAXED);
+    uint32_t free = owner | (owner << 16);
+    return __atomic_compare_exchange_n(&l->word, &free, free + 0x10000, 0,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static inline void ticket_unlock(spinlock_t *l) {
+    __atomic_store_n(&l->t.owner, l->t.owner + 1, __ATOMIC_RELEASE);
+}
+
+/* For locks also taken from interrupt handlers. */
+static inline uint32_t spin_lock_irqsave(spinlock_t *l) {
+    uint32_t flags;
+    __asm__ volatile ("pushf\npop %0\ncli" : "=r"(flags) : : "memory");
+    ticket_lock(l);
+    return flags;
+}
+
+static inline void spin_unlock_irqrestore(spinlock_t *l, uint32_t flags) {
+    ticket_unlock(l);
+    __asm__ volatile ("push %0\npopf" : : "r"(flags) : "memory", "cc");
+}
+
+/* For locks only taken by threads: the holder is not preempted, so no
+ * other thread on its CPU spins behind it. In sched.c. */
+void spin_lock(spinlock_t *l);
+void spin_unlock(spinlock_t *l);
+
+#endif
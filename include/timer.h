@@ -0,0 +1,28 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include "types.h"
+
+/* A timer is embedded in its owner; arming and cancelling never
+ * allocate. While pending it sits on a wheel slot list (pprev != NULL). */
+typedef struct timer {
+    struct timer *next;
+    struct timer **pprev;
+    uint32_t expires;
+    uint32_t slot;
+    void (*fn)(void *arg);
+    void *arg;
+} timer_t;
+
+#define TIMER_INIT(fn, arg) {NULL, NULL, 0, 0, fn, arg}
+
+void timer_init(void);
+void timer_setup(timer_t *t, void (*fn)(void *arg), void *arg);
+void timer_arm(timer_t *t, uint32_t delay_ms);
+void timer_cancel(timer_t *t);
+int timer_pending(const timer_t *t);
+uint32_t timer_ticks(void);
+void timer_pit_tick(void);
+void timer_show_info(void);
+
+#endif
@@ -19,6 +19,7 @@ typedef uint32_t uintptr_t;
 #define FB_HEIGHT 25
 #define FB_BPP 16
 #define FB_BASE 0xB8000
+#define FB_SCREENS 6
 
 #define XFCE_PRELOAD_BASE 0x400000
 #define XFCE_PRELOAD_SIZE 0x800000
@@ -29,6 +30,22 @@ typedef uint32_t uintptr_t;
 #define HEAP_START 0x100000
 #define HEAP_SIZE 0x200000
 
+#define STACK_TOP 0x90000
+#define STACK_SIZE 0x20000
+
+/* Hot-path code and data, grouped by the linker and prefetched at boot. */
+#define HOT_TEXT __attribute__((section(".text.hot")))
+#define HOT_DATA __attribute__((section(".data.hot")))
+
+/* Events posted by interrupt handlers to wake the main loop. */
+#define EV_KEY 0x01
+#define EV_MOUSE 0x02
+#define EV_TICK 0x04
+
+#define MEM_SCRUB_NONE 0
+#define MEM_SCRUB_ALLOC 1
+#define MEM_SCRUB_FREE 2
+
 #define THEME_ORANGE 0
 #define THEME_BLUE 1
 #define THEME_GREEN 2
@@ -74,4 +91,10 @@ static inline void outl(uint16_t port, uint32_t val) {
     __asm__ volatile ("outl %0, %1" : : "a"(val), "Nd"(port));
 }
 
+static inline uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    __asm__ volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
 #endif
\ No newline at end of file
@@ -1,4 +1,56 @@
 #include "types.h"
+#include "paging.h"
+#include "shell.h"
+
+extern uint8_t __text_start[], __bss_end[];
+extern uint8_t __hot_text_start[], __hot_text_end[];
+extern uint8_t __hot_data_start[], __hot_data_end[];
+extern void* mem_alloc(size_t size);
+extern void mem_free(void *ptr);
+extern void mem_set(void *dst, uint8_t val, size_t n);
+
+/* Memory types as used by MTRRs and PAT entries. */
+#define MT_UC 0
+#define MT_WC 1
+#define MT_WT 4
+#define MT_WP 5
+#define MT_WB 6
+#define MT_UC_MINUS 7
+
+#define MSR_MTRRCAP 0xFE
+#define MSR_PAT 0x277
+#define MSR_MTRR_DEF_TYPE 0x2FF
+#define MSR_MTRR_PHYSBASE0 0x200
+#define MSR_MTRR_FIX64K_00000 0x250
+#define MSR_MTRR_FIX16K_80000 0x258
+#define MSR_MTRR_FIX4K_C0000 0x268
+#define MTRR_MAX_VAR 16
+
+/* PAT entry 1 (PWT=1, PCD=0) is switched from WT to WC, so a page with
+ * only PWT set is write-combining. */
+#define PAT_VALUE_LO 0x00070106
+#define PAT_VALUE_HI 0x00070406
+
+static int has_mtrr = 0;
+static int has_pat = 0;
+static int has_clflush = 0;
+static int has_clflushopt = 0;
+static uint32_t line_size = 64;
+static uint32_t mtrr_vcnt = 0;
+static uint32_t phys_mask_hi = 0;
+static uint32_t saved_flags = 0;
+static uint32_t warm_lines = 0;
+static uint32_t warm_resident = 0;
+static uint8_t probe_line[128] __attribute__((aligned(64)));
+
+/* The BSP's MTRRs and PAT, copied to each AP as it comes up. */
+typedef struct {
+    uint32_t msr;
+    uint32_t lo, hi;
+} msr_value_t;
+
+static msr_value_t boot_msrs[MTRR_MAX_VAR * 2 + 13];
+static uint32_t boot_msr_count = 0;
 
 static inline void wbinvd(void) {
     __asm__ volatile ("wbinvd");
@@ -8,8 +60,24 @@ static inline void invd(void) {
     __asm__ volatile ("invd");
 }
 
-static inline void clflush(void *addr) {
-    __asm__ volatile ("clflush (%0)" : : "r"(addr));
+static inline void clflush(const void *addr) {
+    __asm__ volatile ("clflush (%0)" : : "r"(addr) : "memory");
+}
+
+static inline void clflushopt(const void *addr) {
+    __asm__ volatile ("clflushopt (%0)" : : "r"(addr) : "memory");
+}
+
+static inline void prefetch(const void *addr) {
+    __asm__ volatile ("prefetcht0 (%0)" : : "r"(addr));
+}
+
+static inline void mfence(void) {
+    __asm__ volatile ("mfence" : : : "memory");
+}
+
+static inline void sfence(void) {
+    __asm__ volatile ("sfence" : : : "memory");
 }
 
 static inline void wrmsr(uint32_t msr, uint32_t low, uint32_t high) {
@@ -20,21 +88,109 @@ static inline void rdmsr(uint32_t msr, uint32_t *low, uint32_t *high) {
     __asm__ volatile ("rdmsr" : "=a"(*low), "=d"(*high) : "c"(msr));
 }
 
+/* Range maintenance. Each helper touches only the lines in [addr,
+ * addr + size); wbinvd is left for the MTRR/PAT update sequence. */
+void cache_flush_range(const void *addr, size_t size) {
+    if (!has_clflush) {
+        wbinvd();
+        return;
+    }
+
+    uintptr_t p = (uintptr_t)addr & ~(line_size - 1);
+    uintptr_t end = (uintptr_t)addr + size;
+    mfence();
+    if (has_clflushopt) {
+        for (; p < end; p += line_size) clflushopt((const void*)p);
+    } else {
+        for (; p < end; p += line_size) clflush((const void*)p);
+    }
+    mfence();
+}
+
+void cache_prefetch_range(const void *addr, size_t size) {
+    uintptr_t p = (uintptr_t)addr & ~(line_size - 1);
+    uintptr_t end = (uintptr_t)addr + size;
+    for (; p < end; p += line_size) prefetch((const void*)p);
+}
+
+/* Order earlier non-temporal or WC stores before later stores. */
+void cache_store_fence(void) {
+    sfence();
+}
+
+void cache_full_fence(void) {
+    mfence();
+}
+
+uint32_t cache_line_size(void) {
+    return line_size;
+}
+
+/* Caching stays enabled: the region is only pulled into the hierarchy,
+ * it can still be evicted like any other line. */
 void cache_lock_region(uintptr_t base, size_t size) {
-    uint32_t cr0;
-    __asm__ volatile ("mov %%cr0, %0" : "=r"(cr0));
-    cr0 |= (1 << 30);
-    cr0 &= ~(1 << 29);
-    __asm__ volatile ("mov %0, %%cr0" : : "r"(cr0));
-    
-    wrmsr(0x200, 0, 0);
-    wrmsr(0x201, 0x06, 0);
-    
-    for (size_t i = 0; i < size; i += 64) {
-        volatile uint8_t *ptr = (volatile uint8_t*)(base + i);
-        uint8_t dummy = *ptr;
-        (void)dummy;
+    cache_prefetch_range((const void*)base, size);
+    mfence();
+}
+
+/* Load latency of one line in TSC cycles, fenced on both sides. */
+static uint32_t cache_probe(const void *addr) {
+    uint32_t t0, t1, hi;
+    __asm__ volatile ("lfence\nrdtsc\nlfence" : "=a"(t0), "=d"(hi) : : "memory");
+    (void)*(const volatile uint8_t*)addr;
+    __asm__ volatile ("lfence\nrdtsc" : "=a"(t1), "=d"(hi) : : "memory");
+    return t1 - t0;
+}
+
+/* Hit/miss threshold: halfway between a line just loaded and a line just
+ * flushed, best of several tries each. */
+static uint32_t cache_probe_threshold(void) {
+    uint32_t hit = 0xFFFFFFFF, miss = 0xFFFFFFFF;
+    for (int i = 0; i < 8; i++) {
+        (void)*(volatile uint8_t*)probe_line;
+        uint32_t t = cache_probe(probe_line);
+        if (t < hit) hit = t;
+        if (has_clflush) {
+            clflush(probe_line);
+            mfence();
+            t = cache_probe(probe_line);
+            if (t < miss) miss = t;
+        }
     }
+    if (!has_clflush || miss <= hit) return hit * 4;
+    return (hit + miss) / 2;
+}
+
+/* Probe every line of a range in a strided order so the hardware
+ * prefetcher does not fill lines ahead of the probe. */
+static uint32_t cache_probe_range(const uint8_t *start, const uint8_t *end, uint32_t threshold, uint32_t *lines) {
+    uintptr_t base = (uintptr_t)start & ~(line_size - 1);
+    uint32_t n = ((uintptr_t)end - base + line_size - 1) / line_size;
+    uint32_t stride = (n % 167) ? 167 : 1;
+    uint32_t resident = 0;
+    uint32_t idx = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        if (cache_probe((const void*)(base + idx * line_size)) < threshold) resident++;
+        idx = (idx + stride) % n;
+    }
+    *lines += n;
+    return resident;
+}
+
+static uint32_t cache_hot_residency(uint32_t *lines) {
+    uint32_t threshold = cache_probe_threshold();
+    uint32_t resident = 0;
+    *lines = 0;
+    resident += cache_probe_range(__hot_text_start, __hot_text_end, threshold, lines);
+    resident += cache_probe_range(__hot_data_start, __hot_data_end, threshold, lines);
+    return resident;
+}
+
+/* Boot-time warmup of the .text.hot/.data.hot sections. */
+void cache_warm(void) {
+    cache_lock_region((uintptr_t)__hot_text_start, __hot_text_end - __hot_text_start);
+    cache_lock_region((uintptr_t)__hot_data_start, __hot_data_end - __hot_data_start);
+    warm_resident = cache_hot_residency(&warm_lines);
 }
 
 void cache_unlock_all(void) {
@@ -42,15 +198,321 @@ void cache_unlock_all(void) {
     __asm__ volatile ("mov %%cr0, %0" : "=r"(cr0));
     cr0 &= ~((1 << 30) | (1 << 29));
     __asm__ volatile ("mov %0, %%cr0" : : "r"(cr0));
-    
+}
+
+/* MTRR/PAT update sequence from the SDM: caches off and flushed, TLBs
+ * flushed, change, flush again, caches back on. */
+static uint32_t cache_begin_update(void) {
+    uint32_t cr0, cr4;
+    __asm__ volatile ("pushf\npop %0\ncli" : "=r"(saved_flags));
+    __asm__ volatile ("mov %%cr0, %0" : "=r"(cr0));
+    cr0 = (cr0 | (1 << 30)) & ~(1 << 29);
+    __asm__ volatile ("mov %0, %%cr0" : : "r"(cr0));
     wbinvd();
+    __asm__ volatile ("mov %%cr4, %0" : "=r"(cr4));
+    __asm__ volatile ("mov %0, %%cr4" : : "r"(cr4 & ~(1 << 7)));
+    __asm__ volatile ("mov %%cr3, %%eax\nmov %%eax, %%cr3" : : : "eax", "memory");
+    return cr4;
 }
 
-void cache_init(void) {
+static void cache_end_update(uint32_t cr4) {
+    uint32_t cr0;
     wbinvd();
+    __asm__ volatile ("mov %%cr3, %%eax\nmov %%eax, %%cr3" : : : "eax", "memory");
+    __asm__ volatile ("mov %%cr0, %0" : "=r"(cr0));
+    cr0 &= ~((1 << 30) | (1 << 29));
+    __asm__ volatile ("mov %0, %%cr0" : : "r"(cr0));
+    __asm__ volatile ("mov %0, %%cr4" : : "r"(cr4));
+    __asm__ volatile ("push %0\npopf" : : "r"(saved_flags) : "cc");
+}
+
+/* Program one variable-range MTRR. base must be aligned to size and size
+ * must be a power of two, at least 4 KB. */
+int cache_set_range(uintptr_t base, size_t size, int type) {
+    if (!has_mtrr || size < 0x1000 || (size & (size - 1)) || (base & (size - 1))) return -1;
+
+    for (uint32_t i = 0; i < mtrr_vcnt; i++) {
+        uint32_t lo, hi;
+        rdmsr(MSR_MTRR_PHYSBASE0 + 2 * i + 1, &lo, &hi);
+        if (lo & 0x800) continue;
+
+        uint32_t cr4 = cache_begin_update();
+        uint32_t def_lo, def_hi;
+        rdmsr(MSR_MTRR_DEF_TYPE, &def_lo, &def_hi);
+        wrmsr(MSR_MTRR_DEF_TYPE, def_lo & ~0x800, def_hi);
+        wrmsr(MSR_MTRR_PHYSBASE0 + 2 * i, base | type, 0);
+        wrmsr(MSR_MTRR_PHYSBASE0 + 2 * i + 1, (~(size - 1) & 0xFFFFF000) | 0x800, phys_mask_hi);
+        wrmsr(MSR_MTRR_DEF_TYPE, def_lo, def_hi);
+        cache_end_update(cr4);
+        return (int)i;
+    }
+    return -1;
+}
+
+/* Map a range write-combining through PAT entry 1. */
+int cache_map_wc(uintptr_t base, size_t size) {
+    if (!has_pat) return -1;
+    return paging_set_flags(base, size, PG_PWT, PG_PCD);
+}
+
+void cache_init(void) {
+    uint32_t eax = 1, ebx, ecx, edx;
+    __asm__ volatile ("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+    has_mtrr = (edx >> 12) & 1;
+    has_pat = (edx >> 16) & 1;
+    has_clflush = (edx >> 19) & 1;
+    if (has_clflush && ((ebx >> 8) & 0xFF)) line_size = ((ebx >> 8) & 0xFF) * 8;
+
+    eax = 0;
+    __asm__ volatile ("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+    if (eax >= 7) {
+        eax = 7;
+        ecx = 0;
+        __asm__ volatile ("cpuid" : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+        has_clflushopt = (ebx >> 23) & 1;
+    }
+
+    uint32_t phys_bits = 36;
+    eax = 0x80000000;
+    __asm__ volatile ("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+    if (eax >= 0x80000008) {
+        eax = 0x80000008;
+        __asm__ volatile ("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+        phys_bits = eax & 0xFF;
+    }
+    phys_mask_hi = phys_bits > 32 ? (1u << (phys_bits - 32)) - 1 : 0;
+
+    if (has_mtrr) {
+        uint32_t lo, hi, def_lo, def_hi;
+        rdmsr(MSR_MTRRCAP, &lo, &hi);
+        mtrr_vcnt = lo & 0xFF;
+        rdmsr(MSR_MTRR_DEF_TYPE, &def_lo, &def_hi);
+
+        /* Kernel image and stack sit in the fixed ranges below 640 KB. */
+        if ((lo & 0x100) && (def_lo & 0x400)) {
+            uint32_t cr4 = cache_begin_update();
+            wrmsr(MSR_MTRR_DEF_TYPE, def_lo & ~0x800, def_hi);
+            wrmsr(MSR_MTRR_FIX64K_00000, 0x06060606, 0x06060606);
+            wrmsr(MSR_MTRR_FIX16K_80000, 0x06060606, 0x06060606);
+            wrmsr(MSR_MTRR_DEF_TYPE, def_lo, def_hi);
+            cache_end_update(cr4);
+        }
+
+        /* BSS and heap: only needs ranges if RAM is not WB by default. */
+        if (!(def_lo & 0x800) || (def_lo & 0xFF) != MT_WB) {
+            cache_set_range(0x100000, 0x100000, MT_WB);
+            cache_set_range(0x200000, 0x200000, MT_WB);
+        }
+    }
+
+    if (has_pat) {
+        uint32_t cr4 = cache_begin_update();
+        wrmsr(MSR_PAT, PAT_VALUE_LO, PAT_VALUE_HI);
+        cache_end_update(cr4);
+        cache_map_wc(FB_BASE, 0x8000);
+    }
+}
+
+static void cache_save_msr(uint32_t msr) {
+    msr_value_t *v = &boot_msrs[boot_msr_count++];
+    v->msr = msr;
+    rdmsr(msr, &v->lo, &v->hi);
+}
+
+/* Snapshot once the BSP is set up. MTRRs changed later with cache_set_range
+ * apply only to the CPU that ran it. */
+void cache_save_boot(void) {
+    boot_msr_count = 0;
+    if (has_mtrr) {
+        uint32_t lo, hi;
+        rdmsr(MSR_MTRRCAP, &lo, &hi);
+        if (lo & 0x100) {
+            cache_save_msr(MSR_MTRR_FIX64K_00000);
+            cache_save_msr(MSR_MTRR_FIX16K_80000);
+            cache_save_msr(MSR_MTRR_FIX16K_80000 + 1);
+            for (uint32_t i = 0; i < 8; i++) cache_save_msr(MSR_MTRR_FIX4K_C0000 + i);
+        }
+        for (uint32_t i = 0; i < mtrr_vcnt && i < MTRR_MAX_VAR; i++) {
+            cache_save_msr(MSR_MTRR_PHYSBASE0 + 2 * i);
+            cache_save_msr(MSR_MTRR_PHYSBASE0 + 2 * i + 1);
+        }
+        cache_save_msr(MSR_MTRR_DEF_TYPE);
+    }
+    if (has_pat) cache_save_msr(MSR_PAT);
+}
+
+/* Called on each AP before it runs anything: the SDM wants every CPU to
+ * agree on memory types. MTRRs are written with them disabled and
+ * DEF_TYPE goes last, enabling them again. */
+void cache_init_ap(void) {
+    if (!boot_msr_count) return;
+    uint32_t cr4 = cache_begin_update();
+    if (has_mtrr) {
+        uint32_t def_lo, def_hi;
+        rdmsr(MSR_MTRR_DEF_TYPE, &def_lo, &def_hi);
+        wrmsr(MSR_MTRR_DEF_TYPE, def_lo & ~0x800, def_hi);
+    }
+    for (uint32_t i = 0; i < boot_msr_count; i++) {
+        wrmsr(boot_msrs[i].msr, boot_msrs[i].lo, boot_msrs[i].hi);
+    }
+    cache_end_update(cr4);
+}
+
+static const char* cache_type_name(uint32_t type) {
+    switch (type) {
+        case MT_UC: return "UC";
+        case MT_WC: return "WC";
+        case MT_WT: return "WT";
+        case MT_WP: return "WP";
+        case MT_WB: return "WB";
+        case MT_UC_MINUS: return "UC-";
+    }
+    return "??";
+}
+
+static void cache_uint_to_str(uint32_t val, char *buf) {
+    char tmp[12];
+    int len = 0;
+    do { tmp[len++] = '0' + (val % 10); val /= 10; } while (val);
+    for (int i = 0; i < len; i++) buf[i] = tmp[len - 1 - i];
+    buf[len] = 0;
+}
+
+static void cache_print(const char *label, const char *value, uint8_t color) {
+    char line[80];
+    shell_strcopy(line, label);
+    shell_strcopy(line + 20, value);
+    shell_println(line, color);
+}
+
+void cache_show_info(void) {
+    char buf[60];
+    shell_println("=== Cache attributes ===", COLOR_TITLE);
+
+    if (!has_mtrr) {
+        cache_print("  MTRR:             ", "not supported", COLOR_ERROR);
+    } else {
+        uint32_t lo, hi;
+        rdmsr(MSR_MTRRCAP, &lo, &hi);
+        cache_uint_to_str(lo & 0xFF, buf);
+        shell_strcopy(buf + shell_strlen(buf), " variable");
+        if (lo & 0x100) shell_strcopy(buf + shell_strlen(buf), ", fixed");
+        if (lo & 0x400) shell_strcopy(buf + shell_strlen(buf), ", WC");
+        cache_print("  MTRR:             ", buf, COLOR_FG);
+
+        rdmsr(MSR_MTRR_DEF_TYPE, &lo, &hi);
+        shell_strcopy(buf, cache_type_name(lo & 0xFF));
+        shell_strcopy(buf + shell_strlen(buf), (lo & 0x800) ? " (enabled)" : " (disabled)");
+        cache_print("  Default type:     ", buf, COLOR_FG);
+
+        for (uint32_t i = 0; i < mtrr_vcnt; i++) {
+            uint32_t blo, bhi, mlo, mhi;
+            rdmsr(MSR_MTRR_PHYSBASE0 + 2 * i + 1, &mlo, &mhi);
+            if (!(mlo & 0x800)) continue;
+            rdmsr(MSR_MTRR_PHYSBASE0 + 2 * i, &blo, &bhi);
+
+            char label[24];
+            shell_strcopy(label, "  Var  :            ");
+            label[6] = '0' + i % 10;
+            shell_int_to_hex(blo & 0xFFFFF000, buf, 8);
+            shell_strcopy(buf + 10, " ");
+            uint32_t mask = mlo & 0xFFFFF000;
+            if (mask) {
+                cache_uint_to_str((mask & -mask) >> 10, buf + 11);
+                shell_strcopy(buf + shell_strlen(buf), " KB ");
+            } else {
+                shell_strcopy(buf + 11, ">=4 GB ");
+            }
+            shell_strcopy(buf + shell_strlen(buf), cache_type_name(blo & 0xFF));
+            cache_print(label, buf, COLOR_FG);
+        }
+    }
+
+    if (!has_pat) {
+        cache_print("  PAT:              ", "not supported", COLOR_ERROR);
+        return;
+    }
+
+    uint32_t lo, hi;
+    rdmsr(MSR_PAT, &lo, &hi);
+    buf[0] = 0;
+    for (int i = 0; i < 8; i++) {
+        uint32_t entry = (i < 4 ? lo >> (i * 8) : hi >> ((i - 4) * 8)) & 0x7;
+        shell_strcopy(buf + shell_strlen(buf), cache_type_name(entry));
+        if (i < 7) shell_strcopy(buf + shell_strlen(buf), " ");
+    }
+    cache_print("  PAT:              ", buf, COLOR_FG);
+    cache_print("  VGA 0xB8000:      ", "WC (PAT entry 1)", COLOR_INFO);
+}
+
+static void cache_print_residency(const char *label, uint32_t resident, uint32_t lines) {
+    char buf[60];
+    cache_uint_to_str(resident, buf);
+    shell_strcopy(buf + shell_strlen(buf), "/");
+    cache_uint_to_str(lines, buf + shell_strlen(buf));
+    shell_strcopy(buf + shell_strlen(buf), " lines (");
+    cache_uint_to_str(lines ? resident * 100 / lines : 0, buf + shell_strlen(buf));
+    shell_strcopy(buf + shell_strlen(buf), "%)");
+    cache_print(label, buf, COLOR_FG);
+}
+
+void cache_show_warm(void) {
+    char buf[40];
+    uint32_t bytes = (__hot_text_end - __hot_text_start) + (__hot_data_end - __hot_data_start);
+    shell_println("=== Hot working set ===", COLOR_TITLE);
+    cache_uint_to_str(bytes, buf);
+    shell_strcopy(buf + shell_strlen(buf), " bytes");
+    cache_print("  Hot text+data:    ", buf, COLOR_FG);
+    cache_print_residency("  Resident at boot: ", warm_resident, warm_lines);
+
+    uint32_t lines;
+    uint32_t resident = cache_hot_residency(&lines);
+    cache_print_residency("  Resident now:     ", resident, lines);
+    shell_println("  Estimate from load latency vs a flushed line.", COLOR_INFO);
 }
 
 void cache_wipe(void) {
-    wbinvd();
-    invd();
+    cache_flush_range(__text_start, __bss_end - __text_start);
+}
+
+/* Dirty a buffer, then time writing it back with a global wbinvd against
+ * a clflush loop over just that buffer. */
+void cache_bench(void) {
+    static const uint32_t sizes[] = {4096, 65536, 262144};
+    uint8_t *buf = mem_alloc(262144);
+    if (!buf) {
+        shell_println("cachebench: out of memory", COLOR_ERROR);
+        return;
+    }
+
+    shell_println("=== Cache flush benchmark (TSC cycles) ===", COLOR_TITLE);
+    shell_println("  Size        wbinvd      range flush", COLOR_INFO);
+    for (int i = 0; i < 3; i++) {
+        uint32_t size = sizes[i];
+
+        mem_set(buf, 0xA5, size);
+        uint64_t t0 = rdtsc();
+        wbinvd();
+        uint64_t t1 = rdtsc();
+
+        mem_set(buf, 0x5A, size);
+        uint64_t t2 = rdtsc();
+        cache_flush_range(buf, size);
+        uint64_t t3 = rdtsc();
+
+        char line[80];
+        for (int j = 0; j < 79; j++) line[j] = ' ';
+        line[79] = 0;
+        cache_uint_to_str(size / 1024, line + 2);
+        shell_strcopy(line + shell_strlen(line), " KB");
+        line[shell_strlen(line)] = ' ';
+        cache_uint_to_str((uint32_t)(t1 - t0), line + 14);
+        line[shell_strlen(line)] = ' ';
+        cache_uint_to_str((uint32_t)(t3 - t2), line + 26);
+        shell_println(line, COLOR_FG);
+    }
+    shell_println(has_clflushopt ? "  Range flush uses clflushopt." :
+                  has_clflush ? "  Range flush uses clflush." :
+                  "  No clflush: range flush falls back to wbinvd.", COLOR_INFO);
+    mem_free(buf);
 }
\ No newline at end of file
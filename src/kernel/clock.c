@@ -0,0 +1,124 @@
+#include "types.h"
+#include "shell.h"
+
+/* Monotonic clock from the TSC. Its rate is measured once at boot against
+ * PIT channel 2, and cycles are turned into nanoseconds with a fixed-point
+ * multiply: ns = cycles * ns_mult >> CLOCK_SHIFT. */
+#define PIT_HZ 1193182
+#define CLOCK_CAL_COUNT 11932   /* 10 ms of PIT input clock */
+#define CLOCK_CAL_ROUNDS 3
+#define CLOCK_SHIFT 26
+
+static uint64_t tsc_base = 0;
+static uint32_t tsc_khz = 0;
+static uint32_t ns_mult = 0;
+
+/* 64 by 32 bit division in two divl steps, so no libgcc helper is needed. */
+uint64_t clock_div(uint64_t n, uint32_t d, uint32_t *rem) {
+    uint32_t hi = n >> 32, q_hi = hi / d, r = hi % d, q_lo;
+    __asm__ ("divl %4" : "=a"(q_lo), "=d"(r) : "a"((uint32_t)n), "d"(r), "rm"(d));
+    if (rem) *rem = r;
+    return ((uint64_t)q_hi << 32) | q_lo;
+}
+
+/* TSC cycles for one CLOCK_CAL_COUNT one-shot on channel 2, timed by
+ * polling its output on port 0x61. */
+static uint32_t clock_pit_cycles(void) {
+    uint8_t gate = inb(0x61);
+    outb(0x61, (gate & ~0x02) | 0x01);      /* speaker off, gate on */
+    outb(0x43, 0xB0);                        /* channel 2, lo/hi, mode 0 */
+    outb(0x42, CLOCK_CAL_COUNT & 0xFF);
+    outb(0x42, CLOCK_CAL_COUNT >> 8);
+
+    uint64_t t0 = rdtsc();
+    while (!(inb(0x61) & 0x20));
+    uint64_t t1 = rdtsc();
+
+    outb(0x61, gate);
+    return (uint32_t)(t1 - t0);
+}
+
+/* The shortest round is kept, since an SMI or emulator stall can only
+ * make a round longer. */
+void clock_init(void) {
+    uint32_t eax = 1, ebx, ecx, edx;
+    __asm__ volatile ("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+    if (!(edx & (1 << 4))) return;
+
+    uint32_t best = 0xFFFFFFFF;
+    for (int i = 0; i < CLOCK_CAL_ROUNDS; i++) {
+        uint32_t cycles = clock_pit_cycles();
+        if (cycles < best) best = cycles;
+    }
+
+    tsc_khz = clock_div((uint64_t)best * PIT_HZ, CLOCK_CAL_COUNT * 1000, NULL);
+    if (tsc_khz < 16000) {          /* ns_mult must fit 32 bits */
+        tsc_khz = 0;
+        return;
+    }
+    ns_mult = clock_div(1000000ULL << CLOCK_SHIFT, tsc_khz, NULL);
+    tsc_base = rdtsc();
+}
+
+uint64_t HOT_TEXT clock_cycles(void) {
+    return rdtsc() - tsc_base;
+}
+
+uint64_t HOT_TEXT clock_cycles_to_ns(uint64_t cycles) {
+    uint32_t lo = cycles, hi = cycles >> 32;
+    return (((uint64_t)hi * ns_mult) << (32 - CLOCK_SHIFT)) +
+           (((uint64_t)lo * ns_mult) >> CLOCK_SHIFT);
+}
+
+/* 0 until clock_init has calibrated the TSC. */
+uint64_t HOT_TEXT clock_ns(void) {
+    return clock_cycles_to_ns(clock_cycles());
+}
+
+uint32_t clock_ms(void) {
+    return clock_div(clock_ns(), 1000000, NULL);
+}
+
+uint32_t clock_tsc_khz(void) {
+    return tsc_khz;
+}
+
+static char* clock_put_uint(char *p, uint32_t val, int width) {
+    char tmp[12];
+    int len = 0;
+    do { tmp[len++] = '0' + val % 10; val /= 10; } while (val);
+    while (len < width) tmp[len++] = '0';
+    while (len) *p++ = tmp[--len];
+    *p = 0;
+    return p;
+}
+
+void clock_show_uptime(void) {
+    char line[60];
+    if (!tsc_khz) {
+        shell_println("No calibrated TSC", COLOR_ERROR);
+        return;
+    }
+
+    uint32_t us;
+    uint32_t secs = clock_div(clock_ns(), 1000000000, &us);
+    us /= 1000;
+
+    shell_println("=== Uptime ===", COLOR_TITLE);
+    shell_strcopy(line, "  Since boot:   ");
+    char *p = clock_put_uint(line + shell_strlen(line), secs / 3600, 1);
+    *p++ = ':';
+    p = clock_put_uint(p, (secs / 60) % 60, 2);
+    *p++ = ':';
+    p = clock_put_uint(p, secs % 60, 2);
+    *p++ = '.';
+    clock_put_uint(p, us, 6);
+    shell_println(line, COLOR_FG);
+
+    shell_strcopy(line, "  TSC:          ");
+    p = clock_put_uint(line + shell_strlen(line), tsc_khz / 1000, 1);
+    *p++ = '.';
+    p = clock_put_uint(p, tsc_khz % 1000, 3);
+    shell_strcopy(p, " MHz (PIT calibrated)");
+    shell_println(line, COLOR_FG);
+}
@@ -2,6 +2,11 @@
 #include "shell.h"
 #include "filesystem.h"
 #include "teascript.h"
+#include "paging.h"
+#include "sched.h"
+
+extern void* mem_alloc(size_t size);
+extern void mem_free(void *ptr);
 
 int asm_debug = 0;
 
@@ -128,16 +133,7 @@ static void int_to_dec(int val, char *buf) {
     buf[len] = 0;
 }
 
-int tcc_compile(const char *src_file, const char *out_file) {
-    file_t *src = fs_open(src_file);
-    if (!src) {
-        shell_println("Error: source file not found", COLOR_ERROR);
-        return -1;
-    }
-
-    uint8_t source[MAX_FILESIZE];
-    int src_size = fs_read(src, source, MAX_FILESIZE);
-
+static int tcc_compile_source(const uint8_t *source, int src_size, const char *out_file) {
     char labels[MAX_LABELS][16];
     int label_addr[MAX_LABELS];
     int label_count = 0;
@@ -264,13 +260,10 @@ int tcc_compile(const char *src_file, const char *out_file) {
         return -1;
     }
 
-    file_t *out = fs_open(out_file);
-    if (!out) return -1;
-
     uint8_t output[MAX_CODE + 2];
     output[0] = 'T'; output[1] = 'B';
     for (int i = 0; i < code_size; i++) output[2 + i] = code[i];
-    fs_write(out, output, code_size + 2);
+    if (fs_write_file(out_file, output, code_size + 2) < 0) return -1;
 
     char msg[80];
     shell_strcopy(msg, "Compiled: ");
@@ -340,16 +333,7 @@ static void emit_modrm_mem(uint8_t *code, int *cs, int reg, int base, int disp)
     }
 }
 
-int asm_assemble(const char *src_file, const char *out_file) {
-    file_t *src = fs_open(src_file);
-    if (!src) {
-        shell_println("Error: source file not found", COLOR_ERROR);
-        return -1;
-    }
-
-    uint8_t source[MAX_FILESIZE];
-    int src_size = fs_read(src, source, MAX_FILESIZE);
-
+static int asm_assemble_source(const uint8_t *source, int src_size, const char *out_file) {
     char labels[MAX_LABELS][16];
     int label_off[MAX_LABELS];
     int label_count = 0;
@@ -405,6 +389,13 @@ int asm_assemble(const char *src_file, const char *out_file) {
             code[code_size++] = 0xF4;
         } else if (streq(mnemonic, "ret")) {
             code[code_size++] = 0xC3;
+        } else if (streq(mnemonic, "sysenter")) {
+            code[code_size++] = 0x0F;
+            code[code_size++] = 0x34;
+        } else if (streq(mnemonic, "pushf")) {
+            code[code_size++] = 0x9C;
+        } else if (streq(mnemonic, "popf")) {
+            code[code_size++] = 0x9D;
         } else if (streq(mnemonic, "mov")) {
             int base, disp;
             if (parse_bracket(source, &pos, src_size, &base, &disp)) {
@@ -826,12 +817,10 @@ int asm_assemble(const char *src_file, const char *out_file) {
 
     fs_delete(out_file);
     fs_create(out_file);
-    file_t *out = fs_open(out_file);
-    if (!out) {
+    if (fs_write_file(out_file, code, code_size) < 0) {
         shell_println("Error: cannot create output file", COLOR_ERROR);
         return -1;
     }
-    fs_write(out, code, code_size);
 
     char msg[80];
     shell_strcopy(msg, "Assembled: ");
@@ -848,6 +837,31 @@ int asm_assemble(const char *src_file, const char *out_file) {
     return 0;
 }
 
+/* The source goes in a heap buffer: on top of the compilers' own code
+ * and label arrays, MAX_FILESIZE would not fit a thread stack. */
+static int compile_file(const char *src_file, const char *out_file,
+                        int (*compile)(const uint8_t *source, int src_size, const char *out_file)) {
+    uint8_t *source = mem_alloc(MAX_FILESIZE);
+    if (!source) {
+        shell_println("Error: out of memory", COLOR_ERROR);
+        return -1;
+    }
+    int ret = -1;
+    int src_size = fs_read_file(src_file, source, MAX_FILESIZE);
+    if (src_size < 0) shell_println("Error: source file not found", COLOR_ERROR);
+    else ret = compile(source, src_size, out_file);
+    mem_free(source);
+    return ret;
+}
+
+int tcc_compile(const char *src_file, const char *out_file) {
+    return compile_file(src_file, out_file, tcc_compile_source);
+}
+
+int asm_assemble(const char *src_file, const char *out_file) {
+    return compile_file(src_file, out_file, asm_assemble_source);
+}
+
 static void exec_tbc(uint8_t *code, int size) {
     extern ternary_vm_t tvm;
     tvm_init();
@@ -929,21 +943,29 @@ done:
     }
 }
 
-static uint8_t exec_buf[EXEC_BUF_SIZE] __attribute__((aligned(16)));
+static uint8_t exec_buf[EXEC_BUF_SIZE] __attribute__((aligned(4096)));
+
+extern void mem_copy(void *dst, const void *src, size_t n);
+extern void cache_flush_range(const void *addr, size_t size);
+extern int fb_set_direct(int on);
 
 /* Crash recovery - defined in main.c */
-extern uint32_t exec_jmp_buf[6];
-extern volatile int native_running;
 extern int exec_setjmp(uint32_t *buf);
 extern void exec_longjmp(uint32_t *buf, int val);
 
+/* Whether a faulting eip is in the native program's own code. */
+int exec_owns(uint32_t eip) {
+    return eip - (uint32_t)exec_buf < EXEC_BUF_SIZE;
+}
+
 static void exec_native(uint8_t *code, int size) {
     if (size > EXEC_BUF_SIZE) {
         shell_println("Error: binary too large", COLOR_ERROR);
         return;
     }
 
-    for (int i = 0; i < size; i++) exec_buf[i] = code[i];
+    mem_copy(exec_buf, code, size);
+    cache_flush_range(exec_buf, size);
 
     char hdr[60];
     shell_strcopy(hdr, "=== Running Native (");
@@ -975,8 +997,18 @@ static void exec_native(uint8_t *code, int size) {
         }
     }
 
-    native_running = 1;
-    int crash = exec_setjmp(exec_jmp_buf);
+    /* The code page is read-only while it runs, so a program that
+     * scribbles over itself faults into crash recovery. Native code
+     * writes VGA memory itself, so the shadow screen steps aside. */
+    if (fb_set_direct(1) < 0) {
+        shell_println("Error: another VT owns the screen", COLOR_ERROR);
+        return;
+    }
+    paging_set_flags((uintptr_t)exec_buf, EXEC_BUF_SIZE, 0, PG_WRITE);
+    uint32_t jmp_buf[6];
+    thread_t *self = sched_current();
+    self->recover = jmp_buf;
+    int crash = exec_setjmp(jmp_buf);
 
     if (crash) {
         /* Returned here via longjmp from exception handler */
@@ -993,23 +1025,29 @@ static void exec_native(uint8_t *code, int size) {
         shell_println("  Program returned.", COLOR_SUCCESS);
     }
 
-    native_running = 0;
+    self->recover = NULL;
+    fb_set_direct(0);
+    paging_set_flags((uintptr_t)exec_buf, EXEC_BUF_SIZE, PG_WRITE, 0);
 }
 
 int exec_run(const char *filename) {
-    file_t *file = fs_open(filename);
-    if (!file) {
+    uint8_t *data = mem_alloc(MAX_FILESIZE);
+    if (!data) {
+        shell_println("Error: out of memory", COLOR_ERROR);
+        return -1;
+    }
+    int size = fs_read_file(filename, data, MAX_FILESIZE);
+    if (size < 0) {
         shell_println("Error: file not found", COLOR_ERROR);
+        mem_free(data);
         return -1;
     }
 
-    uint8_t data[MAX_FILESIZE];
-    int size = fs_read(file, data, MAX_FILESIZE);
-
     if (size >= 2 && data[0] == 'T' && data[1] == 'B') {
         exec_tbc(data + 2, size - 2);
     } else {
         exec_native(data, size);
     }
+    mem_free(data);
     return 0;
 }
\ No newline at end of file
@@ -2,10 +2,13 @@
 #include "filesystem.h"
 #include "shell.h"
 
+extern void* mem_alloc(size_t size);
+extern void mem_free(void *ptr);
 extern void fb_clear_region(uint32_t x, uint32_t y, uint32_t w, uint32_t h);
 extern void fb_fill_rect(uint32_t x, uint32_t y, uint32_t w, uint32_t h, uint32_t color);
 extern void fb_draw_text(uint32_t x, uint32_t y, const char *text, uint32_t color);
 extern void fb_putchar(uint32_t x, uint32_t y, char c, uint8_t color);
+extern void fb_set_cursor(uint32_t x, uint32_t y);
 
 static editor_t editor;
 
@@ -56,11 +59,9 @@ void editor_open(const char *filename) {
     shell_strcopy(editor.filename, filename);
     editor.active = 1;
 
-    file_t *file = fs_open(filename);
-    if (file) {
-        uint8_t data[MAX_FILESIZE];
-        int size = fs_read(file, data, MAX_FILESIZE);
-
+    uint8_t *data = mem_alloc(MAX_FILESIZE);
+    int size = data ? fs_read_file(filename, data, MAX_FILESIZE) : -1;
+    if (size >= 0) {
         int line = 0, col = 0;
         for (int i = 0; i < size && line < EDITOR_MAX_LINES; i++) {
             if (data[i] == '\n') {
@@ -74,6 +75,7 @@ void editor_open(const char *filename) {
         editor.lines[line][col] = 0;
         editor.line_count = line + 1;
     }
+    if (data) mem_free(data);
 
     editor_render();
 }
@@ -93,29 +95,25 @@ void editor_close(void) {
 }
 
 void editor_save(void) {
-    file_t *file = fs_open(editor.filename);
-    if (!file) {
-        fs_create(editor.filename);
-        file = fs_open(editor.filename);
-    }
+    /* Fails harmlessly if the file is already there. */
+    fs_create(editor.filename);
 
-    if (file) {
-        uint8_t data[MAX_FILESIZE];
-        uint32_t size = 0;
+    uint8_t *data = mem_alloc(MAX_FILESIZE);
+    if (!data) return;
+    uint32_t size = 0;
 
-        for (int i = 0; i < editor.line_count && size < MAX_FILESIZE - 1; i++) {
-            int j = 0;
-            while (editor.lines[i][j] && size < MAX_FILESIZE - 1) {
-                data[size++] = editor.lines[i][j++];
-            }
-            if (i < editor.line_count - 1 && size < MAX_FILESIZE - 1) {
-                data[size++] = '\n';
-            }
+    for (int i = 0; i < editor.line_count && size < MAX_FILESIZE - 1; i++) {
+        int j = 0;
+        while (editor.lines[i][j] && size < MAX_FILESIZE - 1) {
+            data[size++] = editor.lines[i][j++];
+        }
+        if (i < editor.line_count - 1 && size < MAX_FILESIZE - 1) {
+            data[size++] = '\n';
         }
-
-        fs_write(file, data, size);
-        editor.modified = 0;
     }
+
+    if (fs_write_file(editor.filename, data, size) >= 0) editor.modified = 0;
+    mem_free(data);
 }
 
 void editor_render(void) {
@@ -221,7 +219,7 @@ void editor_render(void) {
 
     if (editor.cursor_y - editor.scroll_offset >= 0 &&
         editor.cursor_y - editor.scroll_offset < 21) {
-        fb_putchar(4 + editor.cursor_x, 2 + (editor.cursor_y - editor.scroll_offset), '_', COLOR_ACCENT);
+        fb_set_cursor(4 + editor.cursor_x, 2 + (editor.cursor_y - editor.scroll_offset));
     }
 }
 
@@ -0,0 +1,190 @@
+#include "types.h"
+#include "pmm.h"
+
+extern const uint8_t* font_glyph(uint8_t c);
+extern void mem_copy(void *dst, const void *src, size_t n);
+extern void mem_set(void *dst, uint8_t val, size_t n);
+extern int mem_enable_sse(void);
+extern int cache_map_wc(uintptr_t base, size_t size);
+extern void cache_store_fence(void);
+
+/* Graphics console on a VBE linear framebuffer. The bootloader sets the
+ * mode (make VBE=1) and leaves the VBE mode info at VBE_INFO_ADDR. The
+ * 80x25 cell grid of the framebuffer layer is rendered with 8x16 cells
+ * (the 8x8 font doubled vertically), centred on the screen. Rows are
+ * drawn into a pixel shadow in RAM and copied to the write-combined
+ * framebuffer in one band per flush. */
+#define VBE_STATUS_ADDR 0x1000
+#define VBE_INFO_ADDR 0x1100
+
+#define FBCON_CELL_W 8
+#define FBCON_CELL_H 16
+#define FBCON_GRID_W (FB_WIDTH * FBCON_CELL_W)
+#define FBCON_GRID_H (FB_HEIGHT * FBCON_CELL_H)
+
+typedef struct {
+    uint16_t attributes;
+    uint8_t window_a;
+    uint8_t window_b;
+    uint16_t granularity;
+    uint16_t window_size;
+    uint16_t segment_a;
+    uint16_t segment_b;
+    uint32_t win_func;
+    uint16_t pitch;
+    uint16_t width;
+    uint16_t height;
+    uint8_t char_w;
+    uint8_t char_h;
+    uint8_t planes;
+    uint8_t bpp;
+    uint8_t banks;
+    uint8_t memory_model;
+    uint8_t bank_size;
+    uint8_t image_pages;
+    uint8_t reserved0;
+    uint8_t red_mask;
+    uint8_t red_pos;
+    uint8_t green_mask;
+    uint8_t green_pos;
+    uint8_t blue_mask;
+    uint8_t blue_pos;
+    uint8_t rsv_mask;
+    uint8_t rsv_pos;
+    uint8_t direct_color;
+    uint32_t framebuffer;
+} __attribute__((packed)) vbe_mode_info_t;
+
+static const uint32_t palette[16] = {
+    0x000000, 0x0000AA, 0x00AA00, 0x00AAAA, 0xAA0000, 0xAA00AA, 0xAA5500, 0xAAAAAA,
+    0x555555, 0x5555FF, 0x55FF55, 0x55FFFF, 0xFF5555, 0xFF55FF, 0xFFFF55, 0xFFFFFF
+};
+
+/* One 32-bit mask per pixel for every glyph row, so a row is drawn with
+ * two and/andnot/or steps on 128-bit registers. */
+static uint32_t glyph_masks[128][8][8] __attribute__((aligned(16)));
+static uint32_t cursor_mask[8] __attribute__((aligned(16)));
+
+static uint32_t *lfb = NULL;
+static uint32_t lfb_pitch = 0;
+static uint32_t *pixels = NULL;
+static uint32_t band_first = FB_HEIGHT;
+static uint32_t band_last = 0;
+static int use_sse = 0;
+
+static void fbcon_expand_font(void) {
+    for (int c = 0; c < 128; c++) {
+        const uint8_t *glyph = font_glyph(c);
+        for (int row = 0; row < 8; row++) {
+            for (int x = 0; x < 8; x++) {
+                glyph_masks[c][row][x] = (glyph[row] >> x) & 1 ? 0xFFFFFFFF : 0;
+            }
+        }
+    }
+    for (int x = 0; x < 8; x++) cursor_mask[x] = 0xFFFFFFFF;
+}
+
+/* Returns 1 if the graphics console took over the screen. */
+int fbcon_init(void) {
+#ifndef VBE_CONSOLE
+    return 0;
+#endif
+    vbe_mode_info_t *info = (vbe_mode_info_t*)VBE_INFO_ADDR;
+    if (*(volatile uint32_t*)VBE_STATUS_ADDR == 0) return 0;
+    if (info->bpp != 32 || info->width < FBCON_GRID_W || info->height < FBCON_GRID_H) return 0;
+
+    pixels = pmm_alloc(pmm_order_for(FBCON_GRID_W * FBCON_GRID_H * sizeof(uint32_t)));
+    if (!pixels) return 0;
+
+    size_t lfb_size = (size_t)info->pitch * info->height;
+    cache_map_wc(info->framebuffer, lfb_size);
+    mem_set((void*)info->framebuffer, 0, lfb_size);
+
+    lfb_pitch = info->pitch / sizeof(uint32_t);
+    uint32_t left = ((info->width - FBCON_GRID_W) / 2) & ~(FBCON_CELL_W - 1);
+    uint32_t top = (info->height - FBCON_GRID_H) / 2;
+    lfb = (uint32_t*)info->framebuffer + top * lfb_pitch + left;
+
+    use_sse = mem_enable_sse();
+    fbcon_expand_font();
+    return 1;
+}
+
+static void fbcon_blit(uint32_t *dst, const uint32_t *mask, uint32_t rows, uint32_t fg, uint32_t bg) {
+    size_t stride = FBCON_GRID_W * sizeof(uint32_t);
+    if (use_sse) {
+        __asm__ volatile ("movd %3, %%xmm4\n"
+                          "pshufd $0, %%xmm4, %%xmm4\n"
+                          "movd %4, %%xmm5\n"
+                          "pshufd $0, %%xmm5, %%xmm5\n"
+                          "1:\n"
+                          "movdqa (%1), %%xmm0\n"
+                          "movdqa 16(%1), %%xmm1\n"
+                          "movdqa %%xmm0, %%xmm2\n"
+                          "movdqa %%xmm1, %%xmm3\n"
+                          "pand %%xmm4, %%xmm0\n"
+                          "pand %%xmm4, %%xmm1\n"
+                          "pandn %%xmm5, %%xmm2\n"
+                          "pandn %%xmm5, %%xmm3\n"
+                          "por %%xmm2, %%xmm0\n"
+                          "por %%xmm3, %%xmm1\n"
+                          "movdqa %%xmm0, (%0)\n"
+                          "movdqa %%xmm1, 16(%0)\n"
+                          "movdqa %%xmm0, (%0,%5)\n"
+                          "movdqa %%xmm1, 16(%0,%5)\n"
+                          "lea (%0,%5,2), %0\n"
+                          "add $32, %1\n"
+                          "dec %2\n"
+                          "jnz 1b"
+                          : "+r"(dst), "+r"(mask), "+r"(rows)
+                          : "m"(fg), "m"(bg), "r"(stride) : "memory");
+        return;
+    }
+
+    for (; rows; rows--, mask += 8) {
+        for (int x = 0; x < 8; x++) {
+            uint32_t px = (fg & mask[x]) | (bg & ~mask[x]);
+            dst[x] = px;
+            dst[x + FBCON_GRID_W] = px;
+        }
+        dst += 2 * FBCON_GRID_W;
+    }
+}
+
+/* Render one row of cells into the pixel shadow; cursor is the column
+ * that gets an underline, or -1. */
+void fbcon_draw_row(uint32_t y, const uint16_t *cells, int cursor) {
+    if (!pixels || y >= FB_HEIGHT) return;
+
+    uint32_t *row = pixels + y * FBCON_CELL_H * FBCON_GRID_W;
+    for (int x = 0; x < FB_WIDTH; x++) {
+        uint16_t cell = cells[x];
+        uint8_t c = cell & 0xFF;
+        uint32_t fg = palette[(cell >> 8) & 0x0F];
+        uint32_t bg = palette[(cell >> 12) & 0x0F];
+        uint32_t *dst = row + x * FBCON_CELL_W;
+        fbcon_blit(dst, glyph_masks[c < 128 ? c : 0][0], 8, fg, bg);
+        if (x == cursor) {
+            fbcon_blit(dst + (FBCON_CELL_H - 2) * FBCON_GRID_W, cursor_mask, 1, fg, bg);
+        }
+    }
+
+    if (y < band_first) band_first = y;
+    if (y > band_last) band_last = y;
+}
+
+/* Copy the rows drawn since the last flush to the framebuffer. */
+void fbcon_flush(void) {
+    if (!lfb || band_first > band_last) return;
+
+    uint32_t first = band_first * FBCON_CELL_H;
+    uint32_t last = (band_last + 1) * FBCON_CELL_H;
+    for (uint32_t py = first; py < last; py++) {
+        mem_copy(lfb + py * lfb_pitch, pixels + py * FBCON_GRID_W,
+                 FBCON_GRID_W * sizeof(uint32_t));
+    }
+    cache_store_fence();
+
+    band_first = FB_HEIGHT;
+    band_last = 0;
+}
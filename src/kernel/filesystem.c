@@ -1,16 +1,23 @@
 #include "filesystem.h"
 #include "shell.h"
+#include "pmm.h"
+#include "sched.h"
 
 extern void fb_draw_text(uint32_t x, uint32_t y, const char *text, uint32_t color);
+extern void mem_copy(void *dst, const void *src, size_t n);
 
 static file_t files[MAX_FILES];
 static uint32_t cwd = 0;
-static char pwd_buf[128];
+/* Shell commands on every CPU share the table and the cwd. */
+static spinlock_t fs_lock = SPINLOCK_INIT;
+
+static int fs_store(file_t *file, const uint8_t *data, uint32_t size);
 
 void fs_init(void) {
     for (int i = 0; i < MAX_FILES; i++) {
         files[i].used = 0;
         files[i].size = 0;
+        files[i].data = NULL;
         files[i].name[0] = 0;
         files[i].type = FS_TYPE_FILE;
         files[i].parent = 0;
@@ -311,21 +318,29 @@ void fs_init(void) {
         files[1].type = FS_TYPE_FILE;
         files[1].parent = 0;
         shell_strcopy(files[1].name, "kernel.asm");
-        int sz = 0;
-        while (kernel_asm[sz]) {
-            files[1].data[sz] = kernel_asm[sz];
-            sz++;
-        }
-        files[1].size = sz;
+        int sz = sizeof(kernel_asm) - 1;
+        fs_store(&files[1], (const uint8_t*)kernel_asm, sz);
     }
 }
 
+/* File contents live in page blocks that are taken on first write. */
+static void fs_release(file_t *file) {
+    if (file->data) pmm_free(file->data);
+    file->data = NULL;
+    file->used = 0;
+    file->size = 0;
+    file->name[0] = 0;
+}
+
 int fs_create(const char *name) {
+    spin_lock(&fs_lock);
     for (int i = 0; i < MAX_FILES; i++) {
         if (files[i].used && files[i].parent == cwd &&
             files[i].type == FS_TYPE_FILE &&
-            shell_strcmp(files[i].name, name) == 0)
+            shell_strcmp(files[i].name, name) == 0) {
+            spin_unlock(&fs_lock);
             return -1;
+        }
     }
 
     for (int i = 1; i < MAX_FILES; i++) {
@@ -335,83 +350,105 @@ int fs_create(const char *name) {
             files[i].type = FS_TYPE_FILE;
             files[i].parent = cwd;
             shell_strcopy(files[i].name, name);
+            spin_unlock(&fs_lock);
             return i;
         }
     }
+    spin_unlock(&fs_lock);
     return -1;
 }
 
 int fs_delete(const char *name) {
+    spin_lock(&fs_lock);
     for (int i = 1; i < MAX_FILES; i++) {
         if (files[i].used && files[i].parent == cwd &&
             files[i].type == FS_TYPE_FILE &&
             shell_strcmp(files[i].name, name) == 0) {
-            files[i].used = 0;
-            files[i].size = 0;
-            files[i].name[0] = 0;
+            fs_release(&files[i]);
+            spin_unlock(&fs_lock);
             return 0;
         }
     }
+    spin_unlock(&fs_lock);
     return -1;
 }
 
 int fs_delete_recursive(const char *name) {
+    spin_lock(&fs_lock);
     for (int i = 1; i < MAX_FILES; i++) {
         if (files[i].used && files[i].parent == cwd &&
             shell_strcmp(files[i].name, name) == 0) {
             if (files[i].type == FS_TYPE_DIR) {
                 for (int j = 1; j < MAX_FILES; j++) {
                     if (files[j].used && files[j].parent == (uint32_t)i) {
-                        files[j].used = 0;
-                        files[j].size = 0;
-                        files[j].name[0] = 0;
+                        fs_release(&files[j]);
                     }
                 }
             }
-            files[i].used = 0;
-            files[i].size = 0;
-            files[i].name[0] = 0;
+            fs_release(&files[i]);
+            spin_unlock(&fs_lock);
             return 0;
         }
     }
+    spin_unlock(&fs_lock);
     return -1;
 }
 
-file_t* fs_open(const char *name) {
+/* A file in the cwd, fs_lock held. */
+static file_t* fs_find(const char *name) {
     for (int i = 0; i < MAX_FILES; i++) {
         if (files[i].used && files[i].parent == cwd &&
-            shell_strcmp(files[i].name, name) == 0) {
+            files[i].type == FS_TYPE_FILE &&
+            shell_strcmp(files[i].name, name) == 0)
             return &files[i];
-        }
     }
     return NULL;
 }
 
-int fs_write(file_t *file, const uint8_t *data, uint32_t size) {
-    if (!file || size > MAX_FILESIZE) return -1;
-
-    for (uint32_t i = 0; i < size; i++) {
-        file->data[i] = data[i];
+/* fs_lock held, or at boot. */
+static int fs_store(file_t *file, const uint8_t *data, uint32_t size) {
+    if (size > MAX_FILESIZE) return -1;
+    if (!file->data) {
+        file->data = pmm_alloc(pmm_order_for(MAX_FILESIZE));
+        if (!file->data) return -1;
     }
+
+    mem_copy(file->data, data, size);
     file->size = size;
     return size;
 }
 
-int fs_read(file_t *file, uint8_t *data, uint32_t size) {
-    if (!file) return -1;
+/* Files are only touched by name, with the lock held throughout, since a
+ * shell on another CPU may delete one and its slot be reused. */
+int fs_write_file(const char *name, const uint8_t *data, uint32_t size) {
+    spin_lock(&fs_lock);
+    file_t *file = fs_find(name);
+    int ret = file ? fs_store(file, data, size) : -1;
+    spin_unlock(&fs_lock);
+    return ret;
+}
 
-    uint32_t read_size = size < file->size ? size : file->size;
-    for (uint32_t i = 0; i < read_size; i++) {
-        data[i] = file->data[i];
+/* Copies up to size bytes out; -1 if there is no such file. */
+int fs_read_file(const char *name, uint8_t *data, uint32_t size) {
+    spin_lock(&fs_lock);
+    file_t *file = fs_find(name);
+    int ret = -1;
+    if (file) {
+        ret = size < file->size ? size : file->size;
+        mem_copy(data, file->data, ret);
     }
-    return read_size;
+    spin_unlock(&fs_lock);
+    return ret;
 }
 
 int fs_mkdir(const char *name) {
+    spin_lock(&fs_lock);
     for (int i = 0; i < MAX_FILES; i++) {
         if (files[i].used && files[i].parent == cwd &&
-            shell_strcmp(files[i].name, name) == 0)
+            shell_strcmp(files[i].name, name) == 0) {
+            spin_unlock(&fs_lock);
             return -1;
+        }
     }
 
     for (int i = 1; i < MAX_FILES; i++) {
@@ -421,20 +458,25 @@ int fs_mkdir(const char *name) {
             files[i].type = FS_TYPE_DIR;
             files[i].parent = cwd;
             shell_strcopy(files[i].name, name);
+            spin_unlock(&fs_lock);
             return i;
         }
     }
+    spin_unlock(&fs_lock);
     return -1;
 }
 
 int fs_chdir(const char *name) {
+    spin_lock(&fs_lock);
     if (shell_strcmp(name, "/") == 0) {
         cwd = 0;
+        spin_unlock(&fs_lock);
         return 0;
     }
 
     if (shell_strcmp(name, "..") == 0) {
         cwd = files[cwd].parent;
+        spin_unlock(&fs_lock);
         return 0;
     }
 
@@ -443,17 +485,22 @@ int fs_chdir(const char *name) {
             files[i].type == FS_TYPE_DIR &&
             shell_strcmp(files[i].name, name) == 0) {
             cwd = i;
+            spin_unlock(&fs_lock);
             return 0;
         }
     }
+    spin_unlock(&fs_lock);
     return -1;
 }
 
-const char* fs_pwd(void) {
+/* buf holds at least 128 bytes. */
+void fs_pwd(char *buf) {
+    spin_lock(&fs_lock);
     if (cwd == 0) {
-        pwd_buf[0] = '/';
-        pwd_buf[1] = 0;
-        return pwd_buf;
+        buf[0] = '/';
+        buf[1] = 0;
+        spin_unlock(&fs_lock);
+        return;
     }
 
     char parts[8][MAX_FILENAME];
@@ -468,23 +515,27 @@ const char* fs_pwd(void) {
 
     int pos = 0;
     for (int i = depth - 1; i >= 0; i--) {
-        pwd_buf[pos++] = '/';
+        buf[pos++] = '/';
         int len = shell_strlen(parts[i]);
         for (int j = 0; j < len && pos < 126; j++) {
-            pwd_buf[pos++] = parts[i][j];
+            buf[pos++] = parts[i][j];
         }
     }
-    pwd_buf[pos] = 0;
-    return pwd_buf;
+    buf[pos] = 0;
+    spin_unlock(&fs_lock);
 }
 
 int fs_is_dir(const char *name) {
+    spin_lock(&fs_lock);
     for (int i = 0; i < MAX_FILES; i++) {
         if (files[i].used && files[i].parent == cwd &&
             shell_strcmp(files[i].name, name) == 0) {
-            return files[i].type == FS_TYPE_DIR;
+            int dir = files[i].type == FS_TYPE_DIR;
+            spin_unlock(&fs_lock);
+            return dir;
         }
     }
+    spin_unlock(&fs_lock);
     return 0;
 }
 
@@ -501,30 +552,54 @@ static void int_to_str(uint32_t val, char *buf) {
     buf[len] = 0;
 }
 
-void fs_list(void) {
-    shell_println("=== File System ===", COLOR_TITLE);
-    int count = 0;
+/* The listings copy the cwd's entries out under fs_lock and print them
+ * after dropping it, since printing takes the console and framebuffer
+ * locks and may scroll the whole screen. */
+#define FS_LIST_MAX 18
+
+typedef struct {
+    char name[MAX_FILENAME];
+    uint32_t size;
+    uint8_t type;
+} fs_entry_t;
 
-    for (int i = 0; i < MAX_FILES && count < 18; i++) {
+static int fs_snapshot(fs_entry_t *out) {
+    int count = 0;
+    spin_lock(&fs_lock);
+    for (int i = 0; i < MAX_FILES && count < FS_LIST_MAX; i++) {
         if (files[i].used && files[i].parent == cwd && (uint32_t)i != cwd) {
-            char line[80];
-            int pos = 0;
-            line[pos++] = ' '; line[pos++] = ' ';
+            shell_strcopy(out[count].name, files[i].name);
+            out[count].size = files[i].size;
+            out[count].type = files[i].type;
+            count++;
+        }
+    }
+    spin_unlock(&fs_lock);
+    return count;
+}
 
-            if (files[i].type == FS_TYPE_DIR) {
-                line[pos++] = '[';
-                int nlen = shell_strlen(files[i].name);
-                for (int j = 0; j < nlen; j++) line[pos++] = files[i].name[j];
-                line[pos++] = ']';
-            } else {
-                int nlen = shell_strlen(files[i].name);
-                for (int j = 0; j < nlen; j++) line[pos++] = files[i].name[j];
-            }
-            line[pos] = 0;
+void fs_list(void) {
+    fs_entry_t entries[FS_LIST_MAX];
+    int count = fs_snapshot(entries);
+    shell_println("=== File System ===", COLOR_TITLE);
 
-            shell_println(line, files[i].type == FS_TYPE_DIR ? COLOR_TITLE : COLOR_FG);
-            count++;
+    for (int i = 0; i < count; i++) {
+        char line[80];
+        int pos = 0;
+        line[pos++] = ' '; line[pos++] = ' ';
+
+        if (entries[i].type == FS_TYPE_DIR) {
+            line[pos++] = '[';
+            int nlen = shell_strlen(entries[i].name);
+            for (int j = 0; j < nlen; j++) line[pos++] = entries[i].name[j];
+            line[pos++] = ']';
+        } else {
+            int nlen = shell_strlen(entries[i].name);
+            for (int j = 0; j < nlen; j++) line[pos++] = entries[i].name[j];
         }
+        line[pos] = 0;
+
+        shell_println(line, entries[i].type == FS_TYPE_DIR ? COLOR_TITLE : COLOR_FG);
     }
 
     if (count == 0) {
@@ -533,38 +608,36 @@ void fs_list(void) {
 }
 
 void fs_list_long(void) {
+    fs_entry_t entries[FS_LIST_MAX];
+    int count = fs_snapshot(entries);
     shell_println("=== File System (detailed) ===", COLOR_TITLE);
-    int count = 0;
 
-    for (int i = 0; i < MAX_FILES && count < 18; i++) {
-        if (files[i].used && files[i].parent == cwd && (uint32_t)i != cwd) {
-            char line[80];
-            int pos = 0;
-            line[pos++] = ' '; line[pos++] = ' ';
+    for (int i = 0; i < count; i++) {
+        char line[80];
+        int pos = 0;
+        line[pos++] = ' '; line[pos++] = ' ';
 
-            if (files[i].type == FS_TYPE_DIR) {
-                line[pos++] = 'd'; line[pos++] = 'i'; line[pos++] = 'r';
-            } else {
-                line[pos++] = ' '; line[pos++] = ' '; line[pos++] = ' ';
-            }
+        if (entries[i].type == FS_TYPE_DIR) {
+            line[pos++] = 'd'; line[pos++] = 'i'; line[pos++] = 'r';
+        } else {
+            line[pos++] = ' '; line[pos++] = ' '; line[pos++] = ' ';
+        }
 
-            for (int j = pos; j < 8; j++) line[j] = ' ';
-            pos = 8;
+        for (int j = pos; j < 8; j++) line[j] = ' ';
+        pos = 8;
 
-            char sizebuf[12];
-            int_to_str(files[i].size, sizebuf);
-            int slen = shell_strlen(sizebuf);
-            for (int j = 0; j < 6 - slen; j++) line[pos++] = ' ';
-            for (int j = 0; j < slen; j++) line[pos++] = sizebuf[j];
-            line[pos++] = 'B'; line[pos++] = ' '; line[pos++] = ' ';
+        char sizebuf[12];
+        int_to_str(entries[i].size, sizebuf);
+        int slen = shell_strlen(sizebuf);
+        for (int j = 0; j < 6 - slen; j++) line[pos++] = ' ';
+        for (int j = 0; j < slen; j++) line[pos++] = sizebuf[j];
+        line[pos++] = 'B'; line[pos++] = ' '; line[pos++] = ' ';
 
-            int nlen = shell_strlen(files[i].name);
-            for (int j = 0; j < nlen; j++) line[pos++] = files[i].name[j];
-            line[pos] = 0;
+        int nlen = shell_strlen(entries[i].name);
+        for (int j = 0; j < nlen; j++) line[pos++] = entries[i].name[j];
+        line[pos] = 0;
 
-            shell_println(line, files[i].type == FS_TYPE_DIR ? COLOR_TITLE : COLOR_FG);
-            count++;
-        }
+        shell_println(line, entries[i].type == FS_TYPE_DIR ? COLOR_TITLE : COLOR_FG);
     }
 
     if (count == 0) {
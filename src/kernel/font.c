@@ -1,7 +1,6 @@
 #include "types.h"
 
-extern void fb_put_pixel(uint32_t x, uint32_t y, uint32_t color);
-
+/* 8x8 glyphs for ASCII, bit 0 is the leftmost pixel. */
 static const uint8_t font[128][8] = {
     {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00},     {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00},
     {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00},     {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00},
@@ -19,6 +18,7 @@ static const uint8_t font[128][8] = {
     {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00},     {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00},
     {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00},     {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00},
     {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00},     {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00},
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00},
     {0x18, 0x3C, 0x3C, 0x18, 0x18, 0x00, 0x18, 0x00},     {0x36, 0x36, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00},
     {0x36, 0x36, 0x7F, 0x36, 0x7F, 0x36, 0x36, 0x00},     {0x0C, 0x3E, 0x03, 0x1E, 0x30, 0x1F, 0x0C, 0x00},
     {0x00, 0x63, 0x33, 0x18, 0x0C, 0x66, 0x63, 0x00},     {0x1C, 0x36, 0x1C, 0x6E, 0x3B, 0x33, 0x6E, 0x00},
@@ -68,17 +68,6 @@ static const uint8_t font[128][8] = {
     {0x07, 0x0C, 0x0C, 0x38, 0x0C, 0x0C, 0x07, 0x00},     {0x6E, 0x3B, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}
 };
 
-void fb_draw_char(uint32_t x, uint32_t y, char c, uint32_t color) {
-    if ((unsigned char)c >= 128) return;
-
-    for (int row = 0; row < 8; row++) {
-        uint8_t byte = font[(int)c][row];
-        for (int col = 0; col < 8; col++) {
-            if (byte & (0x80 >> col)) {
-                fb_put_pixel(x + col, y + row, color);
-            } else {
-                fb_put_pixel(x + col, y + row, COLOR_BG);
-            }
-        }
-    }
-}
\ No newline at end of file
+const uint8_t* font_glyph(uint8_t c) {
+    return font[c < 128 ? c : 0];
+}
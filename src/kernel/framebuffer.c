@@ -1,18 +1,254 @@
 #include "types.h"
+#include "pmm.h"
+#include "timer.h"
+#include "smp.h"
+#include "spinlock.h"
+#include "sched.h"
 
-static uint16_t *fb = (uint16_t*)FB_BASE;
+extern void mem_copy(void *dst, const void *src, size_t n);
+extern void mem_move(void *dst, const void *src, size_t n);
+extern void cache_store_fence(void);
+extern int fbcon_init(void);
+extern void fbcon_draw_row(uint32_t y, const uint16_t *cells, int cursor);
+extern void fbcon_flush(void);
+
+/* Drawing goes to a shadow copy of the screen in cached RAM. Rows that
+ * change are marked dirty and fb_flush copies them to VGA memory in
+ * bulk. In direct mode a native program owns VGA memory: writes to its
+ * screen go straight through and VGA memory is that screen's master copy,
+ * laid out linearly. The other screens keep drawing to their shadows and
+ * are brought up to date when the program gives VGA memory back.
+ *
+ * Otherwise rows 23-24 (prompt and debug bar) sit at the start of text
+ * memory and are shown by the CRTC line-compare split, and rows 0-22
+ * live in a ring above them. Scrolling rows 1-22 moves the CRTC start
+ * address by one row instead of moving the cells; when the ring reaches
+ * the end of its page it is rebased and redrawn from the shadow.
+ *
+ * Each screen (one per VT) has its own shadow and its own page of the
+ * 32 KB window, kept up to date even while hidden. Drawing goes to the
+ * selected screen; showing a screen only reprograms the start address
+ * and copies its two split rows. Each screen also keeps a cursor
+ * position, shown with the VGA hardware cursor.
+ *
+ * With the VBE graphics console (fbcon.c) none of the text-mode layout
+ * applies: dirty rows of the shown screen are rendered as pixels instead,
+ * and scrolling just redraws the rows that moved.
+ *
+ * The selected screen belongs to the running thread (thread_t.screen),
+ * so it follows the thread to whichever CPU runs it; before the
+ * scheduler starts it is boot_screen. Cells may be drawn from several CPUs at once: a row's
+ * dirty bit is set atomically after its cells are written, so a flush
+ * that raced with the write is followed by another. fb_lock serialises
+ * what moves a page around: flushing, ring scrolls, showing a screen and
+ * direct mode. */
+#define FB_SPLIT_ROW 23
+#define FB_FLUSH_MS 16
+#define FB_BLINK_MS 500
+#define FB_CELLS (FB_WIDTH * FB_HEIGHT)
+#define FB_RING_BASE ((FB_HEIGHT - FB_SPLIT_ROW) * FB_WIDTH)
+#define FB_VGA_CELLS 0x4000
+#define FB_PAGE_CELLS ((FB_VGA_CELLS - FB_RING_BASE) / FB_SCREENS / FB_WIDTH * FB_WIDTH)
+#define FB_RING_ROWS ((1u << FB_SPLIT_ROW) - 1)
+
+#define CRTC_INDEX 0x3D4
+#define CRTC_DATA 0x3D5
+#define CRTC_OVERFLOW 0x07
+#define CRTC_MAX_SCAN 0x09
+#define CRTC_START_HI 0x0C
+#define CRTC_START_LO 0x0D
+#define CRTC_LINE_COMPARE 0x18
+#define CRTC_CURSOR_START 0x0A
+#define CRTC_CURSOR_END 0x0B
+#define CRTC_CURSOR_HI 0x0E
+#define CRTC_CURSOR_LO 0x0F
+#define CRTC_CURSOR_OFF 0x20
+
+typedef struct {
+    uint16_t *cells;
+    uint32_t dirty_rows;
+    uint32_t scroll_pending;
+    uint32_t page;
+    uint32_t start;
+    uint32_t cursor_x;
+    uint32_t cursor_y;
+} fb_screen_t;
+
+static uint16_t *vga = (uint16_t*)FB_BASE;
+static uint16_t screen0_cells[FB_CELLS];
+static fb_screen_t screens[FB_SCREENS] = {{screen0_cells, 0, 0, FB_RING_BASE, FB_RING_BASE, 0, 0}};
+static int boot_screen = 0;
+static spinlock_t fb_lock = SPINLOCK_INIT;
+static int shown = 0;
+static uint32_t crtc_start = 0;
+static uint32_t crtc_cursor = 0xFFFFFFFF;
+static volatile uint32_t flush_due HOT_DATA = 0;
+static fb_screen_t *direct_screen = NULL;
+static int graphics = 0;
+static uint32_t drawn_cursor_x = 0;
+static uint32_t drawn_cursor_y = 0;
+static volatile int cursor_lit = 1;
+static int drawn_lit = 1;
+static uint32_t char_height = 16;
 static uint32_t fb_width = FB_WIDTH;
 static uint32_t fb_height = FB_HEIGHT;
 
+static void fb_tick(void *arg);
+static void fb_blink(void *arg);
+static timer_t flush_timer = TIMER_INIT(fb_tick, NULL);
+static timer_t blink_timer = TIMER_INIT(fb_blink, NULL);
+
+static uint8_t crtc_read(uint8_t reg) {
+    outb(CRTC_INDEX, reg);
+    return inb(CRTC_DATA);
+}
+
+static void crtc_write(uint8_t reg, uint8_t val) {
+    outw(CRTC_INDEX, ((uint16_t)val << 8) | reg);
+}
+
+static void crtc_set_start(uint32_t cell) {
+    crtc_write(CRTC_START_HI, (cell >> 8) & 0xFF);
+    crtc_write(CRTC_START_LO, cell & 0xFF);
+}
+
+/* The line compare value is 10 bits: bit 8 lives in the overflow
+ * register, bit 9 in the maximum scan line register. */
+static void crtc_set_split(uint32_t line) {
+    crtc_write(CRTC_LINE_COMPARE, line & 0xFF);
+    crtc_write(CRTC_OVERFLOW, (crtc_read(CRTC_OVERFLOW) & ~0x10) | ((line >> 4) & 0x10));
+    crtc_write(CRTC_MAX_SCAN, (crtc_read(CRTC_MAX_SCAN) & ~0x40) | ((line >> 3) & 0x40));
+}
+
+/* Underline cursor on the bottom two scan lines; the VGA blinks it. */
+static void crtc_show_cursor(int on) {
+    if (on) {
+        crtc_write(CRTC_CURSOR_START, char_height - 2);
+        crtc_write(CRTC_CURSOR_END, char_height - 1);
+    } else {
+        crtc_write(CRTC_CURSOR_START, CRTC_CURSOR_OFF);
+    }
+}
+
+/* Going back to the split layout redraws every page from its shadow. */
+static void fb_set_layout(int split) {
+    if (split) {
+        for (int i = 0; i < FB_SCREENS; i++) {
+            screens[i].start = screens[i].page;
+            screens[i].scroll_pending = 0;
+            screens[i].dirty_rows = (1u << fb_height) - 1;
+        }
+        crtc_start = screens[shown].start;
+        crtc_cursor = 0xFFFFFFFF;
+    } else {
+        crtc_start = 0;
+    }
+    if (graphics) return;
+    crtc_set_split(split ? FB_SPLIT_ROW * char_height - 1 : 0x3FF);
+    crtc_set_start(crtc_start);
+    crtc_show_cursor(split);
+}
+
+static inline uint16_t* fb_vga_row(fb_screen_t *s, uint32_t y) {
+    if (y >= FB_SPLIT_ROW) return vga + (y - FB_SPLIT_ROW) * fb_width;
+    return vga + s->start + y * fb_width;
+}
+
+static inline fb_screen_t* fb_cur(void) {
+    thread_t *t = sched_current();
+    return &screens[t ? t->screen : boot_screen];
+}
+
+/* Whether s is the screen a native program has VGA memory for. */
+static inline int fb_direct(fb_screen_t *s) {
+    return s == direct_screen;
+}
+
+static inline void fb_mark(uint32_t y) {
+    __atomic_or_fetch(&fb_cur()->dirty_rows, 1u << y, __ATOMIC_RELEASE);
+}
+
+static inline void fb_mark_rows(uint32_t first, uint32_t last) {
+    uint32_t mask = ((1u << (last - first + 1)) - 1) << first;
+    __atomic_or_fetch(&fb_cur()->dirty_rows, mask, __ATOMIC_RELEASE);
+}
+
 void fb_init(void) {
-    for (uint32_t i = 0; i < fb_width * fb_height; i++) {
-        fb[i] = 0x0F00 | ' ';
+    for (int i = 0; i < FB_SCREENS; i++) {
+        fb_screen_t *s = &screens[i];
+        s->page = FB_RING_BASE + i * FB_PAGE_CELLS;
+        if (i > 0) s->cells = pmm_alloc(pmm_order_for(FB_CELLS * sizeof(uint16_t)));
+        if (!s->cells) continue;
+        for (uint32_t j = 0; j < FB_CELLS; j++) {
+            s->cells[j] = 0x0F00 | ' ';
+        }
     }
+    boot_screen = 0;
+    shown = 0;
+    graphics = fbcon_init();
+    if (graphics) timer_arm(&blink_timer, FB_BLINK_MS);
+    else char_height = (crtc_read(CRTC_MAX_SCAN) & 0x1F) + 1;
+    fb_set_layout(1);
 }
 
-void fb_putchar(uint32_t x, uint32_t y, char c, uint8_t color) {
+/* Direct drawing to a screen; it need not be the one on display. */
+int fb_select(int screen) {
+    if (screen < 0 || screen >= FB_SCREENS || !screens[screen].cells) return -1;
+    thread_t *t = sched_current();
+    if (t) t->screen = screen;
+    else boot_screen = screen;
+    return 0;
+}
+
+int fb_selected(void) {
+    return fb_cur() - screens;
+}
+
+/* Moves the selected screen's cursor; the hardware follows on the next
+ * flush. */
+void fb_set_cursor(uint32_t x, uint32_t y) {
+    if (x >= fb_width) x = fb_width - 1;
+    if (y >= fb_height) y = fb_height - 1;
+    fb_screen_t *scr = fb_cur();
+    scr->cursor_x = x;
+    scr->cursor_y = y;
+}
+
+void HOT_TEXT fb_putchar(uint32_t x, uint32_t y, char c, uint8_t color) {
     if (x >= fb_width || y >= fb_height) return;
-    fb[y * fb_width + x] = (color << 8) | c;
+    uint16_t cell = (color << 8) | (uint8_t)c;
+    fb_screen_t *scr = fb_cur();
+    scr->cells[y * fb_width + x] = cell;
+    if (fb_direct(scr)) vga[y * fb_width + x] = cell;
+    else fb_mark(y);
+}
+
+uint16_t fb_get_cell(uint32_t x, uint32_t y) {
+    if (x >= fb_width || y >= fb_height) return 0;
+    fb_screen_t *scr = fb_cur();
+    return fb_direct(scr) ? vga[y * fb_width + x] : scr->cells[y * fb_width + x];
+}
+
+void fb_set_cell(uint32_t x, uint32_t y, uint16_t cell) {
+    if (x >= fb_width || y >= fb_height) return;
+    fb_screen_t *scr = fb_cur();
+    scr->cells[y * fb_width + x] = cell;
+    if (fb_direct(scr)) vga[y * fb_width + x] = cell;
+    else fb_mark(y);
+}
+
+void fb_read_row(uint32_t y, uint16_t *dst) {
+    if (y >= fb_height) return;
+    fb_screen_t *scr = fb_cur();
+    mem_copy(dst, (fb_direct(scr) ? vga : scr->cells) + y * fb_width, fb_width * sizeof(uint16_t));
+}
+
+void fb_write_row(uint32_t y, const uint16_t *src) {
+    if (y >= fb_height) return;
+    fb_screen_t *scr = fb_cur();
+    mem_copy(scr->cells + y * fb_width, src, fb_width * sizeof(uint16_t));
+    if (fb_direct(scr)) mem_copy(vga + y * fb_width, src, fb_width * sizeof(uint16_t));
+    else fb_mark(y);
 }
 
 void fb_put_pixel(uint32_t x, uint32_t y, uint32_t color) {
@@ -39,16 +275,20 @@ void fb_draw_rect(uint32_t x, uint32_t y, uint32_t w, uint32_t h, uint32_t color
 }
 
 void fb_clear(uint32_t color) {
+    fb_screen_t *scr = fb_cur();
+    uint16_t *shadow = scr->cells;
     for (uint32_t i = 0; i < fb_width * fb_height; i++) {
-        fb[i] = (color << 8) | ' ';
+        shadow[i] = (color << 8) | ' ';
     }
+    if (fb_direct(scr)) mem_copy(vga, shadow, FB_CELLS * sizeof(uint16_t));
+    else fb_mark_rows(0, fb_height - 1);
 }
 
 void fb_draw_char(uint32_t x, uint32_t y, char c, uint32_t color) {
     fb_putchar(x, y, c, color);
 }
 
-void fb_draw_text(uint32_t x, uint32_t y, const char *text, uint32_t color) {
+void HOT_TEXT fb_draw_text(uint32_t x, uint32_t y, const char *text, uint32_t color) {
     uint32_t cx = x;
     while (*text && cx < fb_width) {
         if (*text == '\n') {
@@ -63,9 +303,13 @@ void fb_draw_text(uint32_t x, uint32_t y, const char *text, uint32_t color) {
 }
 
 void fb_wipe(void) {
+    fb_screen_t *scr = fb_cur();
+    uint16_t *shadow = scr->cells;
     for (uint32_t i = 0; i < fb_width * fb_height; i++) {
-        fb[i] = 0;
+        shadow[i] = 0;
     }
+    if (fb_direct(scr)) mem_copy(vga, shadow, FB_CELLS * sizeof(uint16_t));
+    else fb_mark_rows(0, fb_height - 1);
 }
 
 void fb_clear_region(uint32_t x, uint32_t y, uint32_t w, uint32_t h) {
@@ -81,26 +325,213 @@ void fb_draw_text_clear(uint32_t x, uint32_t y, const char *text, uint32_t width
     fb_draw_text(x, y, text, COLOR_FG);
 }
 
-void fb_scroll_up(void) {
-    for (uint32_t y = 1; y < 23; y++) {
+/* Scroll rows top..bottom up by one and blank the bottom row. When the
+ * region covers the whole ring below the status row, VGA memory is left
+ * alone: the next flush moves the start address down one row, and only
+ * the status row and the new bottom rows are copied. */
+void fb_scroll_region(uint32_t top, uint32_t bottom) {
+    if (top >= bottom || bottom >= fb_height) return;
+
+    fb_screen_t *scr = fb_cur();
+    if (fb_direct(scr)) {
+        mem_move(vga + top * fb_width, vga + (top + 1) * fb_width,
+                 (bottom - top) * fb_width * sizeof(uint16_t));
         for (uint32_t x = 0; x < fb_width; x++) {
-            fb[y * fb_width + x] = fb[(y + 1) * fb_width + x];
+            vga[bottom * fb_width + x] = (COLOR_FG << 8) | ' ';
         }
+        return;
     }
 
+    uint16_t *shadow = scr->cells;
+    spin_lock(&fb_lock);
+    mem_move(shadow + top * fb_width, shadow + (top + 1) * fb_width,
+             (bottom - top) * fb_width * sizeof(uint16_t));
     for (uint32_t x = 0; x < fb_width; x++) {
-        fb[23 * fb_width + x] = (COLOR_FG << 8) | ' ';
+        shadow[bottom * fb_width + x] = (COLOR_FG << 8) | ' ';
     }
+    if (!graphics && top == 1 && bottom >= FB_SPLIT_ROW - 1) {
+        uint32_t ring = (FB_RING_ROWS >> 1) & ~1u;
+        uint32_t rows = scr->dirty_rows, moved;
+        do {
+            moved = (rows & ~ring) | ((rows >> 1) & ring) | 1u;
+        } while (!__atomic_compare_exchange_n(&scr->dirty_rows, &rows, moved, 0,
+                                              __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+        fb_mark_rows(FB_SPLIT_ROW - 1, bottom);
+        scr->scroll_pending++;
+    } else {
+        fb_mark_rows(top, bottom);
+    }
+    spin_unlock(&fb_lock);
+}
+
+void fb_scroll_up(void) {
+    fb_scroll_region(1, 23);
 }
 
 void fb_scroll_down(void) {
-    for (uint32_t y = 22; y >= 1 && y < 25; y--) {
-        for (uint32_t x = 0; x < fb_width; x++) {
-            fb[(y + 1) * fb_width + x] = fb[y * fb_width + x];
+    fb_screen_t *scr = fb_cur();
+    uint16_t *buf = fb_direct(scr) ? vga : scr->cells;
+    mem_move(buf + 2 * fb_width, buf + 1 * fb_width, 22 * fb_width * sizeof(uint16_t));
+    for (uint32_t x = 0; x < fb_width; x++) {
+        buf[1 * fb_width + x] = (COLOR_FG << 8) | ' ';
+    }
+    if (!fb_direct(scr)) fb_mark_rows(1, 23);
+}
+
+/* Apply a screen's pending scrolls and copy its dirty rows to its page.
+ * The split rows only exist on screen for the shown screen; a hidden
+ * screen gets them when it is shown. */
+static uint32_t fb_flush_screen(fb_screen_t *s, int visible) {
+    uint32_t rows;
+    uint32_t scrolled = s->scroll_pending;
+    s->scroll_pending = 0;
+    if (visible) {
+        rows = __atomic_exchange_n(&s->dirty_rows, 0, __ATOMIC_ACQUIRE);
+    } else {
+        rows = __atomic_fetch_and(&s->dirty_rows, ~FB_RING_ROWS, __ATOMIC_ACQUIRE) & FB_RING_ROWS;
+    }
+
+    if (scrolled) {
+        s->start += scrolled * fb_width;
+        if (s->start + FB_SPLIT_ROW * fb_width > s->page + FB_PAGE_CELLS) {
+            s->start = s->page;
+            rows |= FB_RING_ROWS;
         }
     }
 
-    for (uint32_t x = 0; x < fb_width; x++) {
-        fb[1 * fb_width + x] = (COLOR_FG << 8) | ' ';
+    uint32_t y = 0;
+    while (rows >> y) {
+        if (!((rows >> y) & 1)) {
+            y++;
+            continue;
+        }
+        uint32_t first = y++;
+        while (y < fb_height && y != FB_SPLIT_ROW && ((rows >> y) & 1)) y++;
+        mem_copy(fb_vga_row(s, first), s->cells + first * fb_width,
+                 (y - first) * fb_width * sizeof(uint16_t));
     }
-}
\ No newline at end of file
+    return rows;
+}
+
+/* Graphics console: render the shown screen's dirty rows, plus the rows
+ * the cursor left and entered. Hidden screens keep their dirty bits and
+ * are redrawn in full when shown. */
+static void fb_render_screen(fb_screen_t *s) {
+    if (s->cursor_x != drawn_cursor_x || s->cursor_y != drawn_cursor_y) {
+        __atomic_or_fetch(&s->dirty_rows, (1u << drawn_cursor_y) | (1u << s->cursor_y), __ATOMIC_RELAXED);
+        drawn_cursor_x = s->cursor_x;
+        drawn_cursor_y = s->cursor_y;
+        cursor_lit = 1;
+        timer_arm(&blink_timer, FB_BLINK_MS);
+    }
+    if (cursor_lit != drawn_lit) {
+        __atomic_or_fetch(&s->dirty_rows, 1u << s->cursor_y, __ATOMIC_RELAXED);
+        drawn_lit = cursor_lit;
+    }
+    uint32_t rows = __atomic_exchange_n(&s->dirty_rows, 0, __ATOMIC_ACQUIRE);
+    s->scroll_pending = 0;
+    for (uint32_t y = 0; rows >> y; y++) {
+        if ((rows >> y) & 1)
+            fbcon_draw_row(y, s->cells + y * fb_width,
+                           y == s->cursor_y && drawn_lit ? (int)s->cursor_x : -1);
+    }
+    fbcon_flush();
+}
+
+/* Bring every page up to date, then point the CRTC at the shown one.
+ * fb_lock held. Nothing is copied while a native program owns VGA
+ * memory; dirty bits wait for it to give it back. */
+static void HOT_TEXT fb_flush_locked(void) {
+    if (direct_screen) return;
+    if (graphics) {
+        fb_render_screen(&screens[shown]);
+        return;
+    }
+
+    uint32_t copied = 0;
+    for (int i = 0; i < FB_SCREENS; i++) {
+        if (screens[i].cells) copied |= fb_flush_screen(&screens[i], i == shown);
+    }
+    if (copied) cache_store_fence();
+    fb_screen_t *s = &screens[shown];
+    if (s->start != crtc_start) {
+        crtc_start = s->start;
+        crtc_set_start(crtc_start);
+    }
+    uint32_t cursor = fb_vga_row(s, s->cursor_y) + s->cursor_x - vga;
+    if (cursor != crtc_cursor) {
+        crtc_cursor = cursor;
+        crtc_write(CRTC_CURSOR_HI, (cursor >> 8) & 0xFF);
+        crtc_write(CRTC_CURSOR_LO, cursor & 0xFF);
+    }
+}
+
+void HOT_TEXT fb_flush(void) {
+    spin_lock(&fb_lock);
+    fb_flush_locked();
+    spin_unlock(&fb_lock);
+}
+
+/* Screen updates reach VGA memory at most every 16 ms. fb_poll, called
+ * from the main loop and the shell output path, arms a timer whose
+ * callback only notes that a flush is due; the flush itself happens in
+ * the next fb_poll, never in the interrupt. The graphics console blinks
+ * its cursor the same way; the VGA cursor blinks by itself. */
+static void HOT_TEXT fb_tick(void *arg) {
+    (void)arg;
+    flush_due = 1;
+}
+
+static void fb_blink(void *arg) {
+    (void)arg;
+    cursor_lit = !cursor_lit;
+    flush_due = 1;
+    timer_arm(&blink_timer, FB_BLINK_MS);
+}
+
+void HOT_TEXT fb_poll(void) {
+    if (!flush_due) {
+        if (!timer_pending(&flush_timer)) timer_arm(&flush_timer, FB_FLUSH_MS);
+        return;
+    }
+    flush_due = 0;
+    fb_flush();
+}
+
+int fb_show(int screen) {
+    if (screen < 0 || screen >= FB_SCREENS || !screens[screen].cells) return -1;
+    spin_lock(&fb_lock);
+    if (direct_screen) {
+        spin_unlock(&fb_lock);
+        return -1;
+    }
+    shown = screen;
+    uint32_t rows = (1u << fb_height) - 1;
+    __atomic_or_fetch(&screens[screen].dirty_rows, graphics ? rows : rows & ~FB_RING_ROWS, __ATOMIC_RELAXED);
+    fb_flush_locked();
+    spin_unlock(&fb_lock);
+    return 0;
+}
+
+/* Hand VGA memory to code that writes it directly for the selected
+ * screen, in the plain linear layout, and take it back afterwards with
+ * whatever that code left on screen. The other pages may have been
+ * overwritten, so all of them are redrawn. -1 if another screen has it. */
+int fb_set_direct(int on) {
+    fb_screen_t *scr = fb_cur();
+    int ret = 0;
+    spin_lock(&fb_lock);
+    if (on && !direct_screen) {
+        mem_copy(vga, scr->cells, FB_CELLS * sizeof(uint16_t));
+        direct_screen = scr;
+        fb_set_layout(0);
+    } else if (on && direct_screen != scr) {
+        ret = -1;
+    } else if (!on && direct_screen == scr) {
+        mem_copy(scr->cells, vga, FB_CELLS * sizeof(uint16_t));
+        fb_set_layout(1);
+        direct_screen = NULL;
+    }
+    spin_unlock(&fb_lock);
+    return ret;
+}
@@ -1,33 +1,76 @@
 #include "types.h"
 
-static uint8_t keyboard_buffer[256];
-uint8_t keyboard_head = 0;
-uint8_t keyboard_tail = 0;
+/* Keys are decoded by the IRQ1 handler into a single-producer,
+ * single-consumer ring. head is only written by the handler and tail only
+ * by keyboard_read; both run freely and are masked on access, so a full
+ * ring is head - tail == KB_RING_SIZE. x86 keeps stores in order and
+ * loads in order, so a compiler barrier between the slot and the index is
+ * enough on either side. */
+#define KB_RING_SIZE 256
+
+#define ring_barrier() __asm__ volatile ("" : : : "memory")
+
+/* Mouse packets are assembled by the IRQ12 handler. Motion only moves the
+ * pointer, so any number of packets between two reads of the position
+ * collapse into one move; button changes are queued with the position
+ * they happened at. */
+#define MOUSE_RING_SIZE 16
+
+typedef struct {
+    uint8_t x;
+    uint8_t y;
+    uint8_t buttons;
+    uint8_t changed;
+} mouse_event_t;
+
+static uint8_t keyboard_buffer[KB_RING_SIZE] HOT_DATA;
+volatile uint32_t keyboard_head HOT_DATA = 0;
+volatile uint32_t keyboard_tail HOT_DATA = 0;
 static uint8_t shift_pressed = 0;
 static uint8_t ctrl_pressed = 0;
 static uint8_t alt_pressed = 0;
 
-static uint32_t mouse_x = 0;
-static uint32_t mouse_y = 0;
-static uint8_t mouse_buttons = 0;
+static volatile uint32_t mouse_x = 0;
+static volatile uint32_t mouse_y = 0;
+static volatile uint8_t mouse_buttons = 0;
+static mouse_event_t mouse_events[MOUSE_RING_SIZE];
+static volatile uint32_t mouse_head = 0;
+static volatile uint32_t mouse_tail = 0;
 
 extern void gui_handle_click(uint32_t x, uint32_t y);
+extern void event_post(uint32_t events);
 
 void keyboard_init(void) {
     keyboard_head = 0;
     keyboard_tail = 0;
 }
 
-uint8_t keyboard_read(void) {
-    if (keyboard_head == keyboard_tail) {
+uint8_t HOT_TEXT keyboard_read(void) {
+    uint32_t tail = keyboard_tail;
+    if (keyboard_head == tail) {
         return 0;
     }
-    uint8_t key = keyboard_buffer[keyboard_tail];
-    keyboard_tail = (keyboard_tail + 1) % 256;
+    ring_barrier();
+    uint8_t key = keyboard_buffer[tail & (KB_RING_SIZE - 1)];
+    ring_barrier();
+    keyboard_tail = tail + 1;
     return key;
 }
 
-void keyboard_handle(void) {
+static void HOT_TEXT keyboard_push(uint8_t key) {
+    uint32_t head = keyboard_head;
+    if (head - keyboard_tail >= KB_RING_SIZE) return;
+    keyboard_buffer[head & (KB_RING_SIZE - 1)] = key;
+    ring_barrier();
+    keyboard_head = head + 1;
+    event_post(EV_KEY);
+}
+
+int keyboard_pending(void) {
+    return keyboard_head != keyboard_tail;
+}
+
+static void HOT_TEXT keyboard_decode(void) {
     uint8_t status = inb(0x64);
     if (!(status & 1)) return;
     if (status & 0x20) return;
@@ -65,45 +108,35 @@ void keyboard_handle(void) {
     if (extended) {
         extended = 0;
         if (scancode == 0x48) {
-            keyboard_buffer[keyboard_head] = alt_pressed ? 6 : 1;
-            keyboard_head = (keyboard_head + 1) % 256;
+            keyboard_push(alt_pressed ? 6 : 1);
         } else if (scancode == 0x50) {
-            keyboard_buffer[keyboard_head] = alt_pressed ? 7 : 2;
-            keyboard_head = (keyboard_head + 1) % 256;
+            keyboard_push(alt_pressed ? 7 : 2);
         } else if (scancode == 0x4B) {
-            keyboard_buffer[keyboard_head] = 4;
-            keyboard_head = (keyboard_head + 1) % 256;
+            keyboard_push(4);
         } else if (scancode == 0x4D) {
-            keyboard_buffer[keyboard_head] = 5;
-            keyboard_head = (keyboard_head + 1) % 256;
+            keyboard_push(5);
         } else if (scancode == 0x49 && alt_pressed) {
-            keyboard_buffer[keyboard_head] = 22;
-            keyboard_head = (keyboard_head + 1) % 256;
+            keyboard_push(22);
         } else if (scancode == 0x51 && alt_pressed) {
-            keyboard_buffer[keyboard_head] = 23;
-            keyboard_head = (keyboard_head + 1) % 256;
+            keyboard_push(23);
         } else if (scancode == 0x1C) {
-            keyboard_buffer[keyboard_head] = 10;
-            keyboard_head = (keyboard_head + 1) % 256;
+            keyboard_push(10);
         }
         return;
     }
 
     if (scancode == 0x1C) {
-        keyboard_buffer[keyboard_head] = 10;
-        keyboard_head = (keyboard_head + 1) % 256;
+        keyboard_push(10);
         return;
     }
 
     if (scancode == 0x3B && !alt_pressed) {
-        keyboard_buffer[keyboard_head] = 3;
-        keyboard_head = (keyboard_head + 1) % 256;
+        keyboard_push(3);
         return;
     }
 
     if (alt_pressed && scancode >= 0x3B && scancode <= 0x40) {
-        keyboard_buffer[keyboard_head] = 16 + (scancode - 0x3B);
-        keyboard_head = (keyboard_head + 1) % 256;
+        keyboard_push(16 + (scancode - 0x3B));
         return;
     }
 
@@ -136,12 +169,17 @@ void keyboard_handle(void) {
                     }
                 }
             }
-            keyboard_buffer[keyboard_head] = c;
-            keyboard_head = (keyboard_head + 1) % 256;
+            keyboard_push(c);
         }
     }
 }
 
+/* IRQ1 handler, called from keyboard_entry with interrupts off. */
+void HOT_TEXT keyboard_irq(void) {
+    keyboard_decode();
+    outb(0x20, 0x20);
+}
+
 uint8_t keyboard_get_modifiers(void) {
     uint8_t mods = 0;
     if (shift_pressed) mods |= 1;
@@ -164,14 +202,29 @@ void mouse_init(void) {
     mouse_x = FB_WIDTH / 2;
     mouse_y = FB_HEIGHT / 2;
     mouse_buttons = 0;
+    mouse_head = 0;
+    mouse_tail = 0;
+}
+
+static void mouse_push(uint8_t buttons, uint8_t changed) {
+    uint32_t head = mouse_head;
+    if (head - mouse_tail >= MOUSE_RING_SIZE) return;
+    mouse_event_t *ev = &mouse_events[head & (MOUSE_RING_SIZE - 1)];
+    ev->x = mouse_x;
+    ev->y = mouse_y;
+    ev->buttons = buttons;
+    ev->changed = changed;
+    ring_barrier();
+    mouse_head = head + 1;
+    event_post(EV_MOUSE);
 }
 
-void mouse_handle(void) {
+static void mouse_decode(void) {
     static int packet_index = 0;
     static uint8_t packet[3];
 
     uint8_t status = inb(0x64);
-    if (!(status & 0x21)) return;
+    if (!(status & 1)) return;
     if (!(status & 0x20)) return;
 
     uint8_t data = inb(0x60);
@@ -201,9 +254,29 @@ void mouse_handle(void) {
 
         uint8_t old_buttons = mouse_buttons;
         mouse_buttons = packet[0] & 0x07;
+        if (mouse_buttons != old_buttons) {
+            mouse_push(mouse_buttons, mouse_buttons ^ old_buttons);
+        }
+    }
+}
+
+/* IRQ12 handler, called from mouse_entry with interrupts off. */
+void HOT_TEXT mouse_irq(void) {
+    mouse_decode();
+    outb(0xA0, 0x20);
+    outb(0x20, 0x20);
+}
 
-        if ((mouse_buttons & 1) && !(old_buttons & 1)) {
-            gui_handle_click(mouse_x, mouse_y);
+/* Deliver queued button presses; does nothing while the mouse is idle. */
+void HOT_TEXT mouse_handle(void) {
+    uint32_t tail = mouse_tail;
+    while (tail != mouse_head) {
+        ring_barrier();
+        mouse_event_t ev = mouse_events[tail & (MOUSE_RING_SIZE - 1)];
+        ring_barrier();
+        mouse_tail = ++tail;
+        if ((ev.changed & 1) && (ev.buttons & 1)) {
+            gui_handle_click(ev.x, ev.y);
         }
     }
 }
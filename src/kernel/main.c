@@ -4,33 +4,62 @@
 #include "editor.h"
 #include "shell.h"
 #include "network.h"
+#include "pmm.h"
+#include "paging.h"
+#include "timer.h"
+#include "sched.h"
+#include "smp.h"
 
 extern void cache_init(void);
+extern void cache_warm(void);
 extern void xfce_init(void);
 extern void mem_init(void);
+extern void mem_set(void *dst, uint8_t val, size_t n);
+extern int exec_owns(uint32_t eip);
+extern uint8_t __bss_start[], __bss_end[];
+extern void clock_init(void);
+extern uint64_t clock_ns(void);
+extern uint64_t clock_cycles_to_ns(uint64_t cycles);
+extern uint64_t clock_div(uint64_t n, uint32_t d, uint32_t *rem);
 extern void fb_init(void);
 extern void fb_clear(uint32_t color);
 extern void fb_fill_rect(uint32_t x, uint32_t y, uint32_t w, uint32_t h, uint32_t color);
 extern void fb_draw_text(uint32_t x, uint32_t y, const char *text, uint32_t color);
 extern void fb_clear_region(uint32_t x, uint32_t y, uint32_t w, uint32_t h);
+extern void fb_set_cell(uint32_t x, uint32_t y, uint16_t cell);
+extern void fb_flush(void);
+extern void fb_poll(void);
+extern int fb_select(int screen);
+extern int fb_show(int screen);
+extern void fb_set_cursor(uint32_t x, uint32_t y);
+extern int fb_selected(void);
 extern void keyboard_init(void);
-extern void keyboard_handle(void);
 extern uint8_t keyboard_read(void);
+extern int keyboard_pending(void);
 extern void mouse_init(void);
 extern void mouse_handle(void);
 
-#define VT_COUNT 6
+#define VT_COUNT FB_SCREENS
+#define VT_KEY_RING 64
 
+/* Each VT runs its commands on its own thread (vt_thread), so a long
+ * command only holds up its own screen. While a command runs, the main
+ * loop hands that VT's keys to it through keys[] for syscalls 2 and 3.
+ * The VT thread may run on another CPU, so the ring is single producer,
+ * single consumer with a barrier between a slot and its index. */
 typedef struct {
     char input_buffer[256];
     int input_len;
-    int cursor_visible;
-    int tick_counter;
     int history_pos;
+    thread_t *thread;
+    volatile int busy;
+    char command[256];
+    uint8_t keys[VT_KEY_RING];
+    volatile uint32_t key_head;
+    volatile uint32_t key_tail;
 } vt_t;
 
 static vt_t vts[VT_COUNT];
-static uint16_t vt_buffers[VT_COUNT][80 * 25];
 static int current_vt = 0;
 static volatile int running = 1;
 static int input_len_prev = 0;
@@ -65,25 +94,142 @@ __asm__(
     ".globl syscall_entry\n"
     "syscall_entry:\n"
     "   pusha\n"
+    "   cld\n"
     "   push %esp\n"
     "   call syscall_dispatch\n"
     "   add $4, %esp\n"
+    "   call sched_irq_exit\n"
     "   popa\n"
     "   iret\n"
 );
 extern void syscall_entry(void);
 
+/* Fast syscall entry through SYSENTER, with the same numbers and
+ * arguments as int 0x80. The caller points ebp at its saved ebp with its
+ * EFLAGS and the return address above it, so programs call a helper that
+ * does
+ *     pushf
+ *     push ebp
+ *     mov ebp, esp
+ *     sysenter
+ * and get back to the caller with every register but eax (and edx for
+ * syscall 7) kept. SYSENTER comes in
+ * with interrupts off on the SYSENTER_ESP stack, which is only used until
+ * the first instruction switches back to the caller's. SYSEXIT would drop
+ * to ring 3, and native programs run in ring 0, so the way out is a plain
+ * ret after popf, which puts the interrupt flag back the way iret does
+ * for int 0x80; SYSENTER has already cleared it, so the helper saves it. */
+__asm__(
+    ".globl sysenter_entry\n"
+    "sysenter_entry:\n"
+    "   mov %ebp, %esp\n"
+    "   pusha\n"
+    "   cld\n"
+    "   push %esp\n"
+    "   call syscall_dispatch\n"
+    "   add $4, %esp\n"
+    "   call sched_irq_exit\n"
+    "   popa\n"
+    "   pop %ebp\n"
+    "   popf\n"
+    "   ret\n"
+);
+extern void sysenter_entry(void);
+
+#define MSR_SYSENTER_CS 0x174
+#define MSR_SYSENTER_ESP 0x175
+#define MSR_SYSENTER_EIP 0x176
+
+static int has_sysenter = 0;
+static uint8_t sysenter_stacks[SMP_MAX_CPUS][256] __attribute__((aligned(16)));
+
+/* Keyboard ISR stub (IRQ1 -> vector 33) */
+__asm__(
+    ".globl keyboard_entry\n"
+    "keyboard_entry:\n"
+    "   pusha\n"
+    "   cld\n"
+    "   call keyboard_irq\n"
+    "   call sched_irq_exit\n"
+    "   popa\n"
+    "   iret\n"
+);
+extern void keyboard_entry(void);
+
+/* Mouse ISR stub (IRQ12 -> vector 44) */
+__asm__(
+    ".globl mouse_entry\n"
+    "mouse_entry:\n"
+    "   pusha\n"
+    "   cld\n"
+    "   call mouse_irq\n"
+    "   call sched_irq_exit\n"
+    "   popa\n"
+    "   iret\n"
+);
+extern void mouse_entry(void);
+
 /* Timer ISR stub (IRQ0 -> vector 32) */
 __asm__(
     ".globl timer_entry\n"
     "timer_entry:\n"
     "   pusha\n"
+    "   cld\n"
     "   call timer_tick\n"
+    "   call sched_irq_exit\n"
     "   popa\n"
     "   iret\n"
 );
 extern void timer_entry(void);
 
+/* Reschedule IPI stub (SMP_RESCHED_VECTOR) */
+__asm__(
+    ".globl resched_entry\n"
+    "resched_entry:\n"
+    "   pusha\n"
+    "   cld\n"
+    "   call smp_resched_irq\n"
+    "   call sched_irq_exit\n"
+    "   popa\n"
+    "   iret\n"
+);
+extern void resched_entry(void);
+
+/* TLB shootdown IPI stub (SMP_TLB_VECTOR) */
+__asm__(
+    ".globl tlb_entry\n"
+    "tlb_entry:\n"
+    "   pusha\n"
+    "   cld\n"
+    "   call smp_tlb_irq\n"
+    "   popa\n"
+    "   iret\n"
+);
+extern void tlb_entry(void);
+
+/* Panic halt IPI stub (SMP_HALT_VECTOR) */
+__asm__(
+    ".globl halt_entry\n"
+    "halt_entry:\n"
+    "   cli\n"
+    "1: hlt\n"
+    "   jmp 1b\n"
+);
+extern void halt_entry(void);
+
+/* Local APIC timer ISR stub (vector 48) */
+__asm__(
+    ".globl lapic_timer_entry\n"
+    "lapic_timer_entry:\n"
+    "   pusha\n"
+    "   cld\n"
+    "   call timer_lapic_irq\n"
+    "   call sched_irq_exit\n"
+    "   popa\n"
+    "   iret\n"
+);
+extern void lapic_timer_entry(void);
+
 /* Exception ISR stubs */
 __asm__(
     ".globl exc_div0_entry\n"
@@ -106,6 +252,7 @@ __asm__(
     "   jmp exc_common\n"
     "exc_common:\n"
     "   pusha\n"
+    "   cld\n"
     "   push %esp\n"
     "   call exception_dispatch\n"
     "   add $4, %esp\n"
@@ -152,10 +299,6 @@ __asm__(
 extern int exec_setjmp(uint32_t *buf);
 extern void exec_longjmp(uint32_t *buf, int val);
 
-/* Crash recovery state - shared with compiler.c */
-uint32_t exec_jmp_buf[6];
-volatile int native_running = 0;
-
 void idt_set_gate(uint8_t num, uint32_t handler) {
     idt[num].offset_low = handler & 0xFFFF;
     idt[num].selector = 0x08;
@@ -169,8 +312,8 @@ void pic_remap(void) {
     outb(0x21, 0x20); outb(0xA1, 0x28);  /* ICW2: vector offsets 32/40 */
     outb(0x21, 0x04); outb(0xA1, 0x02);  /* ICW3: wiring */
     outb(0x21, 0x01); outb(0xA1, 0x01);  /* ICW4: 8086 mode */
-    outb(0x21, 0xFE);                     /* unmask IRQ0 (timer) only */
-    outb(0xA1, 0xFF);                     /* mask all slave IRQs */
+    outb(0x21, 0xF8);                     /* unmask IRQ0 (timer), IRQ1 (keyboard), IRQ2 (cascade) */
+    outb(0xA1, 0xEF);                     /* unmask IRQ12 (mouse) only */
 }
 
 void pit_init(void) {
@@ -180,6 +323,34 @@ void pit_init(void) {
     outb(0x40, (divisor >> 8) & 0xFF);
 }
 
+/* The IDT is shared by all CPUs; each AP loads it once started. */
+void idt_load(void) {
+    struct {
+        uint16_t limit;
+        uint32_t base;
+    } __attribute__((packed)) idtr;
+
+    idtr.limit = sizeof(idt) - 1;
+    idtr.base = (uint32_t)&idt;
+
+    __asm__ volatile ("lidt %0" : : "m"(idtr));
+}
+
+/* Per CPU, after idt_load. CPUID has SEP on the Pentium Pro too, which
+ * lacks SYSENTER; it is told apart by its model and stepping. */
+void sysenter_init(void) {
+    uint32_t eax = 1, ebx, ecx, edx;
+    __asm__ volatile ("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+    uint32_t family = (eax >> 8) & 0xF, model = (eax >> 4) & 0xF, stepping = eax & 0xF;
+    if (!(edx & (1 << 11)) || (family == 6 && model < 3 && stepping < 3)) return;
+
+    uint32_t stack = (uint32_t)sysenter_stacks[smp_cpu_id() + 1];
+    __asm__ volatile ("wrmsr" : : "c"(MSR_SYSENTER_CS), "a"(0x08), "d"(0));
+    __asm__ volatile ("wrmsr" : : "c"(MSR_SYSENTER_ESP), "a"(stack), "d"(0));
+    __asm__ volatile ("wrmsr" : : "c"(MSR_SYSENTER_EIP), "a"((uint32_t)sysenter_entry), "d"(0));
+    has_sysenter = 1;
+}
+
 void idt_init(void) {
     uint32_t handler = (uint32_t)default_handler;
 
@@ -195,118 +366,214 @@ void idt_init(void) {
 
     /* Hardware IRQs (PIC remapped to 32+) */
     idt_set_gate(32, (uint32_t)timer_entry);
+    idt_set_gate(33, (uint32_t)keyboard_entry);
+    idt_set_gate(44, (uint32_t)mouse_entry);
+    idt_set_gate(48, (uint32_t)lapic_timer_entry);
+    idt_set_gate(SMP_RESCHED_VECTOR, (uint32_t)resched_entry);
+    idt_set_gate(SMP_TLB_VECTOR, (uint32_t)tlb_entry);
+    idt_set_gate(SMP_HALT_VECTOR, (uint32_t)halt_entry);
 
     /* Syscall */
     idt_set_gate(0x80, (uint32_t)syscall_entry);
 
-    struct {
-        uint16_t limit;
-        uint32_t base;
-    } __attribute__((packed)) idtr;
-
-    idtr.limit = sizeof(idt) - 1;
-    idtr.base = (uint32_t)&idt;
-
-    __asm__ volatile ("lidt %0" : : "m"(idtr));
+    idt_load();
 }
 
 void halt(void) {
     running = 0;
 }
 
-extern uint8_t keyboard_head;
-extern uint8_t keyboard_tail;
-
-static uint32_t system_ticks = 0;
-
-void draw_debug_bar(void) {
-    volatile uint16_t *vga = (volatile uint16_t*)0xB8000;
-
-    vga[24 * 80 + 0] = (COLOR_INFO << 8) | 'D';
-    vga[24 * 80 + 1] = (COLOR_INFO << 8) | 'E';
-    vga[24 * 80 + 2] = (COLOR_INFO << 8) | 'B';
-    vga[24 * 80 + 3] = (COLOR_INFO << 8) | 'U';
-    vga[24 * 80 + 4] = (COLOR_INFO << 8) | 'G';
-    vga[24 * 80 + 5] = (COLOR_INFO << 8) | ':';
-    vga[24 * 80 + 6] = (COLOR_INFO << 8) | ' ';
-    vga[24 * 80 + 7] = (COLOR_INFO << 8) | 'H';
-    vga[24 * 80 + 8] = (COLOR_INFO << 8) | '=';
-    vga[24 * 80 + 9] = (COLOR_INFO << 8) | ('0' + keyboard_head / 100);
-    vga[24 * 80 + 10] = (COLOR_INFO << 8) | ('0' + (keyboard_head / 10) % 10);
-    vga[24 * 80 + 11] = (COLOR_INFO << 8) | ('0' + keyboard_head % 10);
-    vga[24 * 80 + 12] = (COLOR_INFO << 8) | ' ';
-    vga[24 * 80 + 13] = (COLOR_INFO << 8) | 'T';
-    vga[24 * 80 + 14] = (COLOR_INFO << 8) | '=';
-    vga[24 * 80 + 15] = (COLOR_INFO << 8) | ('0' + keyboard_tail / 100);
-    vga[24 * 80 + 16] = (COLOR_INFO << 8) | ('0' + (keyboard_tail / 10) % 10);
-    vga[24 * 80 + 17] = (COLOR_INFO << 8) | ('0' + keyboard_tail % 10);
-    vga[24 * 80 + 18] = (COLOR_INFO << 8) | ' ';
-    vga[24 * 80 + 19] = (COLOR_INFO << 8) | 'V';
-    vga[24 * 80 + 20] = (COLOR_INFO << 8) | 'T';
-    vga[24 * 80 + 21] = (COLOR_INFO << 8) | '=';
-    vga[24 * 80 + 22] = (COLOR_INFO << 8) | ('0' + current_vt);
-
-    uint32_t seconds = system_ticks / 1000;
-    uint32_t minutes = seconds / 60;
-    uint32_t hours = minutes / 60;
-    seconds %= 60;
-    minutes %= 60;
-    hours %= 24;
-
-    vga[24 * 80 + 60] = (COLOR_INFO << 8) | ('0' + (hours / 10));
-    vga[24 * 80 + 61] = (COLOR_INFO << 8) | ('0' + (hours % 10));
-    vga[24 * 80 + 62] = (COLOR_INFO << 8) | ':';
-    vga[24 * 80 + 63] = (COLOR_INFO << 8) | ('0' + (minutes / 10));
-    vga[24 * 80 + 64] = (COLOR_INFO << 8) | ('0' + (minutes % 10));
-    vga[24 * 80 + 65] = (COLOR_INFO << 8) | ':';
-    vga[24 * 80 + 66] = (COLOR_INFO << 8) | ('0' + (seconds / 10));
-    vga[24 * 80 + 67] = (COLOR_INFO << 8) | ('0' + (seconds % 10));
-
-    vga[24 * 80 + 70] = (COLOR_INFO << 8) | 'N';
-    vga[24 * 80 + 71] = (COLOR_INFO << 8) | 'e';
-    vga[24 * 80 + 72] = (COLOR_INFO << 8) | 't';
-    vga[24 * 80 + 73] = (COLOR_INFO << 8) | ':';
-    vga[24 * 80 + 74] = (COLOR_SUCCESS << 8) | '1';
-    vga[24 * 80 + 75] = (COLOR_INFO << 8) | '/';
-    vga[24 * 80 + 76] = (COLOR_ERROR << 8) | '0';
+extern volatile uint32_t keyboard_head;
+extern volatile uint32_t keyboard_tail;
+
+/* Pending EV_* bits. Interrupt handlers and VT threads post them and the
+ * main loop takes them all at once in event_wait, blocked while there are
+ * none; the CPU halts in the idle thread meanwhile. */
+static volatile uint32_t pending_events HOT_DATA = 0;
+static thread_t *event_thread = NULL;
+
+void HOT_TEXT event_post(uint32_t events) {
+    __atomic_or_fetch(&pending_events, events, __ATOMIC_SEQ_CST);
+    if (event_thread) sched_wake(event_thread);
 }
 
-/* PIT timer handler - called ~1000x/sec via IRQ0 */
-void timer_tick(void) {
-    system_ticks++;
-    if ((system_ticks & 0xFF) == 0)
-        draw_debug_bar();
+static uint32_t HOT_TEXT event_wait(void) {
+    __asm__ volatile ("cli");
+    while (!pending_events)
+        sched_block();
+    uint32_t events = __atomic_exchange_n(&pending_events, 0, __ATOMIC_SEQ_CST);
+    __asm__ volatile ("sti");
+    return events;
+}
+
+/* The debug bar is a retained view: status_view holds what is on screen,
+ * and draw_debug_bar redraws only the fields that differ, at most every
+ * STATUS_REFRESH_MS. status_invalidate forces a full redraw after the
+ * row has been cleared or another screen was shown. A timer wakes the
+ * main loop for the next uptime second, or for a refresh that had to
+ * wait. */
+#define STATUS_REFRESH_MS 100
+
+typedef struct {
+    int valid;
+    uint32_t kb_head;
+    uint32_t kb_tail;
+    int vt;
+    uint32_t uptime;
+} status_view_t;
+
+static status_view_t status_view;
+static uint32_t status_refreshed = 0;
+
+static void status_wake(void *arg) {
+    (void)arg;
+}
+
+static timer_t status_timer = TIMER_INIT(status_wake, NULL);
+
+void status_invalidate(void) {
+    status_view.valid = 0;
+}
+
+static void status_put_text(uint32_t x, const char *text, uint8_t color) {
+    for (; *text; text++, x++)
+        fb_set_cell(x, 24, (color << 8) | (uint8_t)*text);
+}
+
+static void status_put_digits(uint32_t x, uint32_t val, int digits) {
+    for (int i = digits - 1; i >= 0; i--) {
+        fb_set_cell(x + i, 24, (COLOR_INFO << 8) | ('0' + val % 10));
+        val /= 10;
+    }
+}
+
+void HOT_TEXT draw_debug_bar(void) {
+    uint32_t now = timer_ticks();
+    if (status_view.valid && now - status_refreshed < STATUS_REFRESH_MS) {
+        timer_arm(&status_timer, STATUS_REFRESH_MS - (now - status_refreshed));
+        return;
+    }
+    status_refreshed = now;
+    timer_arm(&status_timer, 1000 - now % 1000);
+
+    int full = !status_view.valid;
+    if (full) {
+        status_put_text(0, "DEBUG: H=", COLOR_INFO);
+        status_put_text(12, " T=", COLOR_INFO);
+        status_put_text(18, " VT=", COLOR_INFO);
+        status_put_text(62, ":", COLOR_INFO);
+        status_put_text(65, ":", COLOR_INFO);
+        status_put_text(70, "Net:", COLOR_INFO);
+        status_put_text(74, "1", COLOR_SUCCESS);
+        status_put_text(75, "/", COLOR_INFO);
+        status_put_text(76, "0", COLOR_ERROR);
+    }
+
+    uint32_t head = keyboard_head;
+    uint32_t tail = keyboard_tail;
+    if (full || head != status_view.kb_head) status_put_digits(9, head % 256, 3);
+    if (full || tail != status_view.kb_tail) status_put_digits(15, tail % 256, 3);
+    if (full || current_vt != status_view.vt) status_put_digits(22, current_vt, 1);
+
+    uint32_t uptime = now / 1000;
+    if (full || uptime != status_view.uptime) {
+        uint32_t seconds = uptime % 60;
+        uint32_t minutes = (uptime / 60) % 60;
+        uint32_t hours = (uptime / 3600) % 24;
+        status_put_digits(60, hours, 2);
+        status_put_digits(63, minutes, 2);
+        status_put_digits(66, seconds, 2);
+    }
+
+    status_view.kb_head = head;
+    status_view.kb_tail = tail;
+    status_view.vt = current_vt;
+    status_view.uptime = uptime;
+    status_view.valid = 1;
+}
+
+/* PIT timer handler - called ~1000x/sec via IRQ0, masked once the
+ * local APIC timer takes over */
+void HOT_TEXT timer_tick(void) {
     outb(0x20, 0x20);  /* EOI to master PIC */
+    timer_pit_tick();
 }
 
 /* Exception handler - recovers from native binary crashes */
 void exception_dispatch(uint32_t *regs) {
-    /* regs[8]=vector, regs[9]=error_code */
+    /* regs[8]=vector, regs[9]=error_code, regs[10]=eip */
     uint32_t vector = regs[8];
+    uint32_t fault_addr = 0;
 
-    if (native_running) {
-        const char *msg = "Unknown exception";
-        switch (vector) {
-            case 0:  msg = "Division by zero"; break;
-            case 6:  msg = "Invalid opcode"; break;
-            case 13: msg = "General protection fault"; break;
-            case 14: msg = "Page fault"; break;
-        }
+    if (vector == 14) {
+        __asm__ volatile ("mov %%cr2, %0" : "=r"(fault_addr));
+        if (paging_handle_fault(fault_addr, regs[9])) return;
+    }
+
+    const char *msg = "Unknown exception";
+    switch (vector) {
+        case 0:  msg = "Division by zero"; break;
+        case 6:  msg = "Invalid opcode"; break;
+        case 13: msg = "General protection fault"; break;
+        case 14: msg = paging_fault_reason(fault_addr, regs[9]); break;
+    }
+
+    /* Only the thread running the native program may recover, and only
+     * from a fault in the program's own code: one inside a syscall may
+     * hold console_lock or fs_lock, which the crash message would then
+     * deadlock on. Anything else is a kernel bug. */
+    thread_t *cur = sched_current();
+    if (cur && cur->recover && exec_owns(regs[10]) && !smp_this_cpu()->preempt_count) {
+        uint32_t *buf = cur->recover;
         char line[60];
         shell_strcopy(line, "  Crash: ");
         int l = shell_strlen(line);
         shell_strcopy(line + l, msg);
         shell_println(line, COLOR_ERROR);
 
-        native_running = 0;
+        cur->recover = NULL;
         __asm__ volatile ("sti");
-        exec_longjmp(exec_jmp_buf, (int)vector + 1);
+        exec_longjmp(buf, (int)vector + 1);
     }
 
     /* Kernel fault outside native execution - halt */
+    smp_halt_others();
+    char line[80];
+    shell_strcopy(line, "Kernel panic: ");
+    shell_strcopy(line + 14, msg);
+    if (vector == 14) {
+        int l = shell_strlen(line);
+        shell_strcopy(line + l, " at ");
+        shell_int_to_hex(fault_addr, line + l + 4, 8);
+    }
+    fb_draw_text(0, 24, line, COLOR_ERROR);
+    fb_flush();
     __asm__ volatile ("cli\nhlt");
 }
 
+/* Keys for a running command; the line editor reads the keyboard ring
+ * directly. Full rings drop keys, as the keyboard ring does. */
+static void vt_push_key(vt_t *vt, uint8_t key) {
+    if (vt->key_head - vt->key_tail < VT_KEY_RING) {
+        vt->keys[vt->key_head % VT_KEY_RING] = key;
+        __asm__ volatile ("" : : : "memory");
+        vt->key_head++;
+    }
+    sched_wake(vt->thread);
+}
+
+/* A VT without a thread runs commands on the main loop and reads the
+ * keyboard itself. */
+static uint8_t vt_read_key(vt_t *vt) {
+    if (!vt->thread) return keyboard_read();
+    if (vt->key_head == vt->key_tail) return 0;
+    __asm__ volatile ("" : : : "memory");
+    uint8_t key = vt->keys[vt->key_tail % VT_KEY_RING];
+    __asm__ volatile ("" : : : "memory");
+    vt->key_tail++;
+    return key;
+}
+
 /* pusha order: edi[0] esi[1] ebp[2] esp[3] ebx[4] edx[5] ecx[6] eax[7] */
 void syscall_dispatch(uint32_t *regs) {
     uint32_t num  = regs[7]; /* eax = syscall number */
@@ -317,21 +584,16 @@ void syscall_dispatch(uint32_t *regs) {
         case 1: /* putchar: bl = character */
             shell_putchar((char)(arg1 & 0xFF), COLOR_FG);
             break;
-        case 2: /* readkey (blocking): returns key in eax */
-            __asm__ volatile ("sti"); /* let timer IRQ fire while waiting */
-            while (1) {
-                keyboard_handle();
-                uint8_t key = keyboard_read();
-                if (key) {
-                    regs[7] = key;
-                    break;
-                }
-                for (volatile int d = 0; d < 1000; d++);
-            }
+        case 2: { /* readkey (blocking): returns key in eax */
+            vt_t *vt = &vts[fb_selected()];
+            uint8_t key;
+            while (!(key = vt_read_key(vt)))
+                sched_block();
+            regs[7] = key;
             break;
+        }
         case 3: /* getkey (non-blocking): returns key in eax, 0=none */
-            keyboard_handle();
-            regs[7] = keyboard_read();
+            regs[7] = vt_read_key(&vts[fb_selected()]);
             break;
         case 4: /* putchar with color: bl=char, cl=color */
             shell_putchar((char)(arg1 & 0xFF), arg2 & 0xFF);
@@ -339,15 +601,76 @@ void syscall_dispatch(uint32_t *regs) {
         case 5: /* clear output area */
             shell_clear_output();
             break;
-        case 6: /* get ticks: returns system_ticks in eax */
-            regs[7] = system_ticks;
+        case 6: /* get ticks: returns milliseconds since boot in eax */
+            regs[7] = timer_ticks();
+            break;
+        case 7: { /* get time: returns nanoseconds since boot in edx:eax */
+            uint64_t ns = clock_ns();
+            regs[7] = (uint32_t)ns;
+            regs[5] = (uint32_t)(ns >> 32);
+            break;
+        }
+        case 8: /* sleep: ebx = milliseconds */
+            sched_sleep(arg1);
             break;
         default:
             break;
     }
 }
 
+#define SYSCALL_BENCH_CALLS 100000
+
+static void bench_print(const char *path, uint64_t cycles) {
+    char line[60];
+    uint32_t per_call = clock_div(cycles, SYSCALL_BENCH_CALLS, NULL);
+    uint32_t ns = clock_div(clock_cycles_to_ns(cycles), SYSCALL_BENCH_CALLS, NULL);
+    for (int i = 0; i < 59; i++) line[i] = ' ';
+    line[59] = 0;
+    int len = shell_strlen(path);
+    for (int i = 0; i < len; i++) line[2 + i] = path[i];
+    char *fields[2] = {line + 16, line + 30};
+    uint32_t vals[2] = {per_call, ns};
+    for (int f = 0; f < 2; f++) {
+        char tmp[12];
+        int n = 0;
+        do { tmp[n++] = '0' + vals[f] % 10; vals[f] /= 10; } while (vals[f]);
+        for (int i = 0; i < n; i++) fields[f][i] = tmp[n - 1 - i];
+    }
+    shell_println(line, COLOR_FG);
+}
+
+/* Null syscalls (number 0) through each entry, from this thread. */
+void syscall_bench(void) {
+    shell_println("=== Syscall benchmark (100000 null calls) ===", COLOR_TITLE);
+    shell_println("  Path          cycles/call   ns/call", COLOR_INFO);
+
+    uint64_t start = rdtsc();
+    for (int i = 0; i < SYSCALL_BENCH_CALLS; i++) {
+        uint32_t num = 0;
+        __asm__ volatile ("int $0x80" : "+a"(num) : : "memory");
+    }
+    bench_print("int 0x80", rdtsc() - start);
+
+    if (!has_sysenter) {
+        shell_println("  No SYSENTER on this CPU.", COLOR_INFO);
+        return;
+    }
+    start = rdtsc();
+    for (int i = 0; i < SYSCALL_BENCH_CALLS; i++) {
+        uint32_t num = 0;
+        __asm__ volatile ("push $1f\n"
+                          "pushf\n"
+                          "push %%ebp\n"
+                          "mov %%esp, %%ebp\n"
+                          "sysenter\n"
+                          "1:"
+                          : "+a"(num) : : "memory");
+    }
+    bench_print("sysenter", rdtsc() - start);
+}
+
 void draw_status_bar(void) {
+    status_invalidate();
     if (editor_is_active()) return;
 
     theme_t t = themes[current_theme];
@@ -373,45 +696,59 @@ void draw_prompt(void) {
     fb_draw_text(0, 23, "tea@teos:~$ ", t.accent);
 }
 
-void vt_save(int vt_num) {
-    volatile uint16_t *vga = (volatile uint16_t*)0xB8000;
-    for (int i = 0; i < 80 * 25; i++) {
-        vt_buffers[vt_num][i] = vga[i];
+/* Each VT has its own screen page; switching just shows it. Refused
+ * while a native program owns the screen, since its VT stays visible. */
+void vt_switch(int new_vt) {
+    if (new_vt == current_vt || new_vt < 0 || new_vt >= VT_COUNT) return;
+    int old = fb_selected();
+    if (fb_select(new_vt) < 0) return;
+    if (fb_show(new_vt) < 0) {
+        fb_select(old);
+        return;
     }
-}
 
-void vt_restore(int vt_num) {
-    volatile uint16_t *vga = (volatile uint16_t*)0xB8000;
-    for (int i = 0; i < 80 * 25; i++) {
-        vga[i] = vt_buffers[vt_num][i];
-    }
+    current_vt = new_vt;
+    status_invalidate();
 }
 
-void vt_switch(int new_vt) {
-    if (new_vt == current_vt || new_vt < 0 || new_vt >= VT_COUNT) return;
+static void vt_thread(void *arg) {
+    vt_t *vt = arg;
+    for (;;) {
+        __asm__ volatile ("cli");
+        while (!vt->busy)
+            sched_block();
+        __asm__ volatile ("sti");
 
-    vt_save(current_vt);
-    current_vt = new_vt;
-    vt_restore(current_vt);
+        shell_execute(vt->command);
+        fb_clear_region(12, 23, 68, 1);
+        draw_prompt();
+        vt->busy = 0;
+        event_post(EV_TICK);
+    }
 }
 
+/* Needs the screens from fb_init; each thread draws on its VT's screen. */
 void vt_init_all(void) {
+    static const char *names[VT_COUNT] = {"tty1", "tty2", "tty3", "tty4", "tty5", "tty6"};
+    int selected = fb_selected();
+
     for (int i = 0; i < VT_COUNT; i++) {
         for (int j = 0; j < 256; j++) {
             vts[i].input_buffer[j] = 0;
         }
         vts[i].input_len = 0;
-        vts[i].cursor_visible = 1;
-        vts[i].tick_counter = 0;
         vts[i].history_pos = -1;
-
-        for (int j = 0; j < 80 * 25; j++) {
-            vt_buffers[i][j] = 0x0F00 | ' ';
-        }
+        vts[i].busy = 0;
+        vts[i].key_head = 0;
+        vts[i].key_tail = 0;
+        vts[i].thread = NULL;
+        if (fb_select(i) == 0)
+            vts[i].thread = thread_create(names[i], vt_thread, &vts[i], SCHED_PRIO_SHELL);
     }
+    fb_select(selected);
 }
 
-void handle_input(void) {
+void HOT_TEXT handle_input(void) {
     uint8_t key = keyboard_read();
     if (key == 0) return;
 
@@ -438,6 +775,11 @@ void handle_input(void) {
         return;
     }
 
+    if (vt->busy) {
+        vt_push_key(vt, key);
+        return;
+    }
+
     if (editor_is_active()) {
         editor_handle_key(key);
         return;
@@ -455,16 +797,24 @@ void handle_input(void) {
         prompt_line[plen + cmd_len] = 0;
         shell_println(prompt_line, t.accent);
 
+        int queued = 0;
         if (vt->input_len > 0) {
             add_to_history(vt->input_buffer);
-            shell_execute(vt->input_buffer);
+            if (vt->thread) {
+                shell_strcopy(vt->command, vt->input_buffer);
+                vt->busy = 1;
+                sched_wake(vt->thread);
+                queued = 1;
+            } else {
+                shell_execute(vt->input_buffer);
+            }
         }
         vt->input_len = 0;
         for (int i = 0; i < 256; i++) vt->input_buffer[i] = 0;
         vt->history_pos = -1;
         input_len_prev = 0;
         fb_clear_region(12, 23, 68, 1);
-        draw_prompt();
+        if (!queued) draw_prompt();
     } else if (key == '\b') {
         if (vt->input_len > 0) {
             vt->input_len--;
@@ -502,11 +852,21 @@ void handle_input(void) {
 
 void __attribute__((section(".text.entry"))) kmain(void) {
     running = 1;
+    mem_set(__bss_start, 0, __bss_end - __bss_start);
+    smp_early_init();
 
     pic_remap();
     idt_init();
+    sysenter_init();
     pit_init();
+    clock_init();
+    pmm_init();
+    paging_init();
+    timer_init();
+    cache_init();
     mem_init();
+    xfce_init();
+    cache_warm();
     fb_init();
     keyboard_init();
     mouse_init();
@@ -515,6 +875,9 @@ void __attribute__((section(".text.entry"))) kmain(void) {
     shell_init();
     editor_init();
     net_init();
+    sched_init();
+    smp_init();
+    event_thread = sched_current();
 
     vt_init_all();
 
@@ -525,9 +888,10 @@ void __attribute__((section(".text.entry"))) kmain(void) {
     fb_draw_text(2, 2,"Welcome to TeaOS!", t.title);
     fb_draw_text(2, 3,"Type 'whoami' to meet TeaOS, or 'help' for commands.", COLOR_FG);
     draw_prompt();
-    vt_save(0);
 
+    /* The other VTs are drawn straight into their own hidden pages. */
     for (int i = 1; i < VT_COUNT; i++) {
+        if (fb_select(i) < 0) continue;
         fb_clear(COLOR_FG);
         current_vt = i;
         draw_status_bar();
@@ -550,18 +914,22 @@ void __attribute__((section(".text.entry"))) kmain(void) {
         fb_draw_text(2, 2, tty_msg, t.title);
         fb_draw_text(2, 3, "Type 'help' for available commands", COLOR_FG);
         draw_prompt();
-        vt_save(i);
     }
 
     current_vt = 0;
-    vt_restore(0);
+    fb_select(0);
+    fb_show(0);
 
     __asm__ volatile ("sti");
 
     while (running) {
-        keyboard_handle();
-        mouse_handle();
-        handle_input();
+        uint32_t events = event_wait();
+
+        if (events & EV_MOUSE) mouse_handle();
+        if (events & EV_KEY) {
+            handle_input();
+            if (keyboard_pending()) event_post(EV_KEY);
+        }
 
         vt_t *vt = &vts[current_vt];
 
@@ -572,22 +940,14 @@ void __attribute__((section(".text.entry"))) kmain(void) {
             input_len_prev = vt->input_len;
         }
 
-        vt->tick_counter++;
-        if (vt->tick_counter > 50000) {
-            vt->cursor_visible = !vt->cursor_visible;
-            vt->tick_counter = 0;
-
-            if (vt->input_len < 67) {
-                theme_t t = themes[current_theme];
-                fb_draw_text(12 + vt->input_len, 23, vt->cursor_visible ? "_" : " ", vt->cursor_visible ? t.accent : COLOR_FG);
-            }
-        }
+        if (!editor_is_active())
+            fb_set_cursor(12 + vt->input_len, 23);
 
         draw_debug_bar();
-
-        for (volatile int i = 0; i < 1000; i++);
+        fb_poll();
     }
 
+    fb_flush();
     __asm__ volatile (
         "cli\n"
         "hlt\n"
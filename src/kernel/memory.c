@@ -1,84 +1,837 @@
 #include "types.h"
+#include "shell.h"
+#include "pmm.h"
+#include "sched.h"
 
 static uint8_t heap[HEAP_SIZE] __attribute__((aligned(4096)));
 static size_t heap_offset __attribute__((unused)) = 0;
 
+/* Boundary-tagged blocks: a header in front of the payload and a copy of
+ * size/used behind it, so free can find both physical neighbours in O(1).
+ * Free blocks are kept on a doubly linked list threaded through headers. */
 typedef struct block {
     size_t size;
     int used;
+    struct block *prev;
     struct block *next;
 } block_t;
 
-static block_t *head = NULL;
+typedef struct block_tag {
+    size_t size;
+    int used;
+} block_tag_t;
+
+#define BLOCK_OVERHEAD (sizeof(block_t) + sizeof(block_tag_t))
+
+static block_t *free_list HOT_DATA = NULL;
+static int scrub_policy = MEM_SCRUB_FREE;
+
+/* Every arena (the static heap and any page blocks taken from the page
+ * allocator) starts with a used prologue tag and ends with a used
+ * epilogue header, so neighbour lookups never leave the arena. */
+#define ARENA_MIN_ORDER 4
+#define ARENA_OVERHEAD (sizeof(block_tag_t) + sizeof(block_t))
+
+static uint32_t arena_count = 0;
+static uint32_t arena_bytes = 0;
+
+/* Size-class slabs: 16..2048 byte objects carved from 4 KB pages taken
+ * off the top of the heap. The block list grows up from the bottom,
+ * slab pages grow down from slab_brk.
+ *
+ * Each page counts its live objects. Once a class has more than
+ * SLAB_KEEP_EMPTY empty pages, slab_sweep takes their objects off the
+ * class list and gives the pages up: the one at slab_brk goes back to the
+ * block list, the others become spare pages for any class.
+ *
+ * When the heap has neither a spare page nor a free block at slab_brk,
+ * slab pages come from the page allocator and go back to it when empty.
+ * Their state is kept in slab_map, one entry per page frame, set up the
+ * first time one is needed. */
+#define SLAB_SIZE 4096
+#define SLAB_MIN 16
+#define SLAB_MAX 2048
+#define SLAB_CLASSES 8
+#define SLAB_KEEP_EMPTY 1
+
+typedef struct slab_obj {
+    struct slab_obj *next;
+} slab_obj_t;
+
+/* cls is the class + 1, or 0 for a spare page. */
+typedef struct {
+    uint8_t cls;
+    uint16_t live;
+} slab_page_t;
+
+static slab_obj_t *slab_free[SLAB_CLASSES] HOT_DATA;
+static uint32_t slab_empty[SLAB_CLASSES];
+static slab_page_t slab_pages[HEAP_SIZE / SLAB_SIZE];
+static slab_page_t *slab_map = NULL;
+static uint32_t slab_map_frames = 0;
+static slab_obj_t *slab_spare = NULL;
+static uint32_t slab_page_count = 0;
+static uint8_t *slab_brk = NULL;
+
+static inline void mem_scrub(void *dst, size_t n) {
+    __asm__ volatile ("rep stosl" : "+D"(dst), "+c"(n) : "a"(0) : "memory");
+}
+
+static block_tag_t* block_footer(block_t *b) {
+    return (block_tag_t*)((uint8_t*)b + sizeof(block_t) + b->size);
+}
+
+static void block_set(block_t *b, size_t size, int used) {
+    b->size = size;
+    b->used = used;
+    block_tag_t *tag = block_footer(b);
+    tag->size = size;
+    tag->used = used;
+}
+
+static block_t* block_next(block_t *b) {
+    return (block_t*)((uint8_t*)block_footer(b) + sizeof(block_tag_t));
+}
+
+static block_t* block_prev(block_t *b) {
+    block_tag_t *tag = (block_tag_t*)((uint8_t*)b - sizeof(block_tag_t));
+    if (tag->used) return NULL;
+    return (block_t*)((uint8_t*)tag - tag->size - sizeof(block_t));
+}
+
+static void block_set_epilogue(uint8_t *end) {
+    block_t *epilogue = (block_t*)(end - sizeof(block_t));
+    epilogue->size = 0;
+    epilogue->used = 1;
+}
+
+static void free_list_insert(block_t *b) {
+    b->prev = NULL;
+    b->next = free_list;
+    if (free_list) free_list->prev = b;
+    free_list = b;
+}
+
+static void free_list_remove(block_t *b) {
+    if (b->prev) b->prev->next = b->next;
+    else free_list = b->next;
+    if (b->next) b->next->prev = b->prev;
+}
+
+static int slab_class(size_t size) {
+    int cls = 0;
+    size_t csize = SLAB_MIN;
+    while (csize < size) {
+        csize <<= 1;
+        cls++;
+    }
+    return cls;
+}
+
+static inline int slab_in_heap(const void *ptr) {
+    return (const uint8_t*)ptr >= heap && (const uint8_t*)ptr < heap + HEAP_SIZE;
+}
+
+/* The slab state of the page ptr is in; NULL or a zero cls if that is
+ * not a slab page. */
+static inline slab_page_t* slab_page_of(const void *ptr) {
+    if (slab_in_heap(ptr)) return &slab_pages[((const uint8_t*)ptr - heap) / SLAB_SIZE];
+    uint32_t pfn = (uintptr_t)ptr >> PAGE_SHIFT;
+    return pfn < slab_map_frames ? &slab_map[pfn] : NULL;
+}
+
+static inline int slab_owns(const void *ptr) {
+    slab_page_t *sp = slab_page_of(ptr);
+    return sp && sp->cls;
+}
+
+static uint8_t* slab_take_pmm_page(void) {
+    if (!slab_map) {
+        uint32_t frames = pmm_frame_count();
+        slab_map = pmm_alloc(pmm_order_for(frames * sizeof(slab_page_t)));
+        if (!slab_map) return NULL;
+        mem_scrub(slab_map, frames * sizeof(slab_page_t) / 4);
+        slab_map_frames = frames;
+    }
+
+    uint8_t *page = pmm_alloc(0);
+    if (!page) return NULL;
+    if ((uintptr_t)page >> PAGE_SHIFT >= slab_map_frames) {
+        pmm_free(page);
+        return NULL;
+    }
+    /* Pages come back from the page allocator dirty. */
+    if (scrub_policy == MEM_SCRUB_FREE) mem_scrub(page, SLAB_SIZE / 4);
+    return page;
+}
+
+/* A spare page, a new one off the last free block, or one from the page
+ * allocator. */
+static uint8_t* slab_take_page(void) {
+    if (slab_spare) {
+        uint8_t *page = (uint8_t*)slab_spare;
+        slab_spare = slab_spare->next;
+        return page;
+    }
+
+    block_tag_t *tag = (block_tag_t*)(slab_brk - ARENA_OVERHEAD);
+    if (tag->used || tag->size < SLAB_SIZE + 8) return slab_take_pmm_page();
+
+    block_t *last = (block_t*)((uint8_t*)tag - tag->size - sizeof(block_t));
+    block_set(last, last->size - SLAB_SIZE, 0);
+    mem_scrub(tag, ARENA_OVERHEAD / 4);
+    slab_brk -= SLAB_SIZE;
+    block_set_epilogue(slab_brk);
+    return slab_brk;
+}
+
+/* Hands the page at slab_brk back to the last block, or makes it a new
+ * free block if the last one is in use. */
+static void slab_return_brk(void) {
+    block_t *epilogue = (block_t*)(slab_brk - sizeof(block_t));
+    block_tag_t *tag = (block_tag_t*)((uint8_t*)epilogue - sizeof(block_tag_t));
+    slab_brk += SLAB_SIZE;
+    block_set_epilogue(slab_brk);
+    if (!tag->used) {
+        block_t *last = (block_t*)((uint8_t*)tag - tag->size - sizeof(block_t));
+        block_set(last, last->size + SLAB_SIZE, 0);
+    } else {
+        block_set(epilogue, SLAB_SIZE - BLOCK_OVERHEAD, 0);
+        free_list_insert(epilogue);
+    }
+}
+
+static void slab_put_page(uint8_t *page) {
+    slab_page_of(page)->cls = 0;
+    slab_page_count--;
+    if (!slab_in_heap(page)) {
+        pmm_free(page);
+        return;
+    }
+    if (page != slab_brk) {
+        slab_obj_t *spare = (slab_obj_t*)page;
+        spare->next = slab_spare;
+        slab_spare = spare;
+        return;
+    }
+
+    /* Spare pages that end up at slab_brk follow it. */
+    slab_return_brk();
+    while (slab_brk < heap + HEAP_SIZE && !slab_page_of(slab_brk)->cls) {
+        slab_obj_t **link = &slab_spare;
+        while (*link != (slab_obj_t*)slab_brk) link = &(*link)->next;
+        *link = (*link)->next;
+        slab_return_brk();
+    }
+}
+
+static int slab_grow(int cls) {
+    uint8_t *page = slab_take_page();
+    if (!page) return 0;
+    slab_page_t *sp = slab_page_of(page);
+    sp->cls = cls + 1;
+    sp->live = 0;
+    slab_empty[cls]++;
+    slab_page_count++;
+
+    size_t osize = (size_t)SLAB_MIN << cls;
+    for (size_t off = 0; off < SLAB_SIZE; off += osize) {
+        slab_obj_t *obj = (slab_obj_t*)(page + off);
+        obj->next = slab_free[cls];
+        slab_free[cls] = obj;
+    }
+    return 1;
+}
+
+/* Unlinks the objects of the class's empty pages, keeping each page's
+ * first object (every page has one at offset 0) on a list of its own,
+ * and only then gives the pages up, since that writes into them. */
+static void slab_sweep(int cls) {
+    slab_obj_t *pages = NULL;
+    slab_obj_t **link = &slab_free[cls];
+    while (*link) {
+        slab_obj_t *obj = *link;
+        if (slab_page_of(obj)->live) {
+            link = &obj->next;
+            continue;
+        }
+        *link = obj->next;
+        if (!((uintptr_t)obj & (SLAB_SIZE - 1))) {
+            obj->next = pages;
+            pages = obj;
+        }
+    }
+    while (pages) {
+        slab_obj_t *next = pages->next;
+        slab_put_page((uint8_t*)pages);
+        pages = next;
+    }
+    slab_empty[cls] = 0;
+}
+
+static void* slab_alloc(size_t size) {
+    int cls = slab_class(size);
+    if (!slab_free[cls] && !slab_grow(cls)) return NULL;
+
+    slab_obj_t *obj = slab_free[cls];
+    slab_free[cls] = obj->next;
+    if (slab_page_of(obj)->live++ == 0) slab_empty[cls]--;
+    if (scrub_policy == MEM_SCRUB_ALLOC) {
+        mem_scrub(obj, ((size_t)SLAB_MIN << cls) / 4);
+    } else {
+        obj->next = NULL;
+    }
+    return obj;
+}
+
+static void slab_release(void *ptr) {
+    slab_page_t *sp = slab_page_of(ptr);
+    int cls = sp->cls - 1;
+
+    if (scrub_policy == MEM_SCRUB_FREE) {
+        mem_scrub(ptr, ((size_t)SLAB_MIN << cls) / 4);
+    }
+
+    slab_obj_t *obj = (slab_obj_t*)ptr;
+    obj->next = slab_free[cls];
+    slab_free[cls] = obj;
+    if (--sp->live == 0 && ++slab_empty[cls] > SLAB_KEEP_EMPTY) slab_sweep(cls);
+}
+
+static void arena_init(uint8_t *base, size_t size) {
+    block_tag_t *prologue = (block_tag_t*)base;
+    prologue->size = 0;
+    prologue->used = 1;
+    block_set_epilogue(base + size);
+
+    block_t *first = (block_t*)(base + sizeof(block_tag_t));
+    block_set(first, size - ARENA_OVERHEAD - BLOCK_OVERHEAD, 0);
+    free_list_insert(first);
+}
+
+static int heap_grow(size_t size) {
+    uint32_t order = pmm_order_for(size + ARENA_OVERHEAD + BLOCK_OVERHEAD);
+    if (order < ARENA_MIN_ORDER) order = ARENA_MIN_ORDER;
+
+    uint8_t *base = pmm_alloc(order);
+    if (!base) return 0;
+
+    /* Pages come back from the page allocator dirty. */
+    if (scrub_policy == MEM_SCRUB_FREE) mem_scrub(base, ((size_t)PAGE_SIZE << order) / 4);
+    arena_init(base, (size_t)PAGE_SIZE << order);
+    arena_count++;
+    arena_bytes += (uint32_t)PAGE_SIZE << order;
+    return 1;
+}
+
+/* mem_copy/mem_set back ends, picked once from CPUID in mem_init.
+ * Until then the plain rep movsd/stosd versions are used. */
+#define MEM_NT_THRESHOLD (L2_CACHE_SIZE / 2)
+
+typedef void (*copy_fn_t)(void *dst, const void *src, size_t n);
+typedef void (*set_fn_t)(void *dst, uint8_t val, size_t n);
+
+static void copy_rep(void *dst, const void *src, size_t n) {
+    size_t dwords = n >> 2;
+    __asm__ volatile ("rep movsl\n"
+                      "mov %3, %%ecx\n"
+                      "rep movsb"
+                      : "+D"(dst), "+S"(src), "+c"(dwords)
+                      : "r"(n & 3) : "memory");
+}
+
+static void set_rep(void *dst, uint8_t val, size_t n) {
+    size_t dwords = n >> 2;
+    __asm__ volatile ("rep stosl\n"
+                      "mov %3, %%ecx\n"
+                      "rep stosb"
+                      : "+D"(dst), "+c"(dwords)
+                      : "a"(val * 0x01010101u), "r"(n & 3) : "memory");
+}
+
+static void copy_erms(void *dst, const void *src, size_t n) {
+    __asm__ volatile ("rep movsb" : "+D"(dst), "+S"(src), "+c"(n) : : "memory");
+}
+
+static void set_erms(void *dst, uint8_t val, size_t n) {
+    __asm__ volatile ("rep stosb" : "+D"(dst), "+c"(n) : "a"(val) : "memory");
+}
+
+static void copy_sse2(void *dst, const void *src, size_t n) {
+    uint8_t *d = (uint8_t*)dst;
+    const uint8_t *s = (const uint8_t*)src;
+
+    if (n < 128) {
+        copy_rep(d, s, n);
+        return;
+    }
+
+    size_t lead = (16 - ((uintptr_t)d & 15)) & 15;
+    copy_rep(d, s, lead);
+    d += lead;
+    s += lead;
+    n -= lead;
+
+    size_t blocks = n >> 6;
+    if (n >= MEM_NT_THRESHOLD) {
+        __asm__ volatile ("1:\n"
+                          "movdqu (%1), %%xmm0\n"
+                          "movdqu 16(%1), %%xmm1\n"
+                          "movdqu 32(%1), %%xmm2\n"
+                          "movdqu 48(%1), %%xmm3\n"
+                          "movntdq %%xmm0, (%0)\n"
+                          "movntdq %%xmm1, 16(%0)\n"
+                          "movntdq %%xmm2, 32(%0)\n"
+                          "movntdq %%xmm3, 48(%0)\n"
+                          "add $64, %1\n"
+                          "add $64, %0\n"
+                          "dec %2\n"
+                          "jnz 1b\n"
+                          "sfence"
+                          : "+r"(d), "+r"(s), "+r"(blocks) : : "memory");
+    } else {
+        __asm__ volatile ("1:\n"
+                          "movdqu (%1), %%xmm0\n"
+                          "movdqu 16(%1), %%xmm1\n"
+                          "movdqu 32(%1), %%xmm2\n"
+                          "movdqu 48(%1), %%xmm3\n"
+                          "movdqa %%xmm0, (%0)\n"
+                          "movdqa %%xmm1, 16(%0)\n"
+                          "movdqa %%xmm2, 32(%0)\n"
+                          "movdqa %%xmm3, 48(%0)\n"
+                          "add $64, %1\n"
+                          "add $64, %0\n"
+                          "dec %2\n"
+                          "jnz 1b"
+                          : "+r"(d), "+r"(s), "+r"(blocks) : : "memory");
+    }
+
+    copy_rep(d, s, n & 63);
+}
+
+static void set_sse2(void *dst, uint8_t val, size_t n) {
+    uint8_t *d = (uint8_t*)dst;
+
+    if (n < 128) {
+        set_rep(d, val, n);
+        return;
+    }
+
+    size_t lead = (16 - ((uintptr_t)d & 15)) & 15;
+    set_rep(d, val, lead);
+    d += lead;
+    n -= lead;
+
+    size_t blocks = n >> 6;
+    uint32_t pattern = val * 0x01010101u;
+    if (n >= MEM_NT_THRESHOLD) {
+        __asm__ volatile ("movd %2, %%xmm0\n"
+                          "pshufd $0, %%xmm0, %%xmm0\n"
+                          "1:\n"
+                          "movntdq %%xmm0, (%0)\n"
+                          "movntdq %%xmm0, 16(%0)\n"
+                          "movntdq %%xmm0, 32(%0)\n"
+                          "movntdq %%xmm0, 48(%0)\n"
+                          "add $64, %0\n"
+                          "dec %1\n"
+                          "jnz 1b\n"
+                          "sfence"
+                          : "+r"(d), "+r"(blocks) : "r"(pattern) : "memory");
+    } else {
+        __asm__ volatile ("movd %2, %%xmm0\n"
+                          "pshufd $0, %%xmm0, %%xmm0\n"
+                          "1:\n"
+                          "movdqa %%xmm0, (%0)\n"
+                          "movdqa %%xmm0, 16(%0)\n"
+                          "movdqa %%xmm0, 32(%0)\n"
+                          "movdqa %%xmm0, 48(%0)\n"
+                          "add $64, %0\n"
+                          "dec %1\n"
+                          "jnz 1b"
+                          : "+r"(d), "+r"(blocks) : "r"(pattern) : "memory");
+    }
+
+    set_rep(d, val, n & 63);
+}
+
+static copy_fn_t copy_impl HOT_DATA = copy_rep;
+static set_fn_t set_impl HOT_DATA = set_rep;
+static const char *copy_impl_name = "rep movsd";
+
+/* Clear CR0.EM, set CR0.MP and CR4.OSFXSR/OSXMMEXCPT so SSE instructions
+ * can be used. Returns 0 if the CPU has no SSE2. */
+int mem_enable_sse(void) {
+    uint32_t eax, ebx, ecx, edx;
+    __asm__ volatile ("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1));
+    if (!(edx & (1 << 26)) || !(edx & (1 << 24))) return 0;
+
+    uint32_t cr0, cr4;
+    __asm__ volatile ("mov %%cr0, %0" : "=r"(cr0));
+    cr0 &= ~(1 << 2);
+    cr0 |= (1 << 1);
+    __asm__ volatile ("mov %0, %%cr0" : : "r"(cr0));
+    __asm__ volatile ("mov %%cr4, %0" : "=r"(cr4));
+    cr4 |= (1 << 9) | (1 << 10);
+    __asm__ volatile ("mov %0, %%cr4" : : "r"(cr4));
+    return 1;
+}
+
+static void mem_select_impl(void) {
+    uint32_t eax, ebx, ecx, edx;
+    __asm__ volatile ("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0));
+    uint32_t max_leaf = eax;
+
+    int has_erms = 0;
+    if (max_leaf >= 7) {
+        __asm__ volatile ("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(7), "c"(0));
+        has_erms = (ebx >> 9) & 1;
+    }
+
+    if (has_erms) {
+        copy_impl = copy_erms;
+        set_impl = set_erms;
+        copy_impl_name = "rep movsb (ERMSB)";
+    } else if (mem_enable_sse()) {
+        copy_impl = copy_sse2;
+        set_impl = set_sse2;
+        copy_impl_name = "SSE2 movdqa/movntdq";
+    }
+}
+
+const char* mem_copy_name(void) {
+    return copy_impl_name;
+}
+
+void HOT_TEXT mem_copy(void *dst, const void *src, size_t n) {
+    copy_impl(dst, src, n);
+}
+
+void HOT_TEXT mem_set(void *dst, uint8_t val, size_t n) {
+    set_impl(dst, val, n);
+}
+
+void mem_move(void *dst, const void *src, size_t n) {
+    uint8_t *d = (uint8_t*)dst;
+    const uint8_t *s = (const uint8_t*)src;
+
+    if (d <= s || d >= s + n) {
+        copy_impl(d, s, n);
+        return;
+    }
+
+    /* overlapping with dst above src: copy backwards, tail bytes first */
+    size_t tail = n & 3;
+    size_t dwords = n >> 2;
+    const uint8_t *ts = s + n - 1;
+    uint8_t *td = d + n - 1;
+    const uint8_t *ws = s + (dwords << 2) - 4;
+    uint8_t *wd = d + (dwords << 2) - 4;
+    __asm__ volatile ("std\n"
+                      "rep movsb\n"
+                      "mov %3, %%esi\n"
+                      "mov %4, %%edi\n"
+                      "mov %5, %%ecx\n"
+                      "rep movsl\n"
+                      "cld"
+                      : "+D"(td), "+S"(ts), "+c"(tail)
+                      : "m"(ws), "m"(wd), "m"(dwords) : "memory");
+}
 
 void mem_init(void) {
-    head = (block_t*)heap;
-    head->size = HEAP_SIZE - sizeof(block_t);
-    head->used = 0;
-    head->next = NULL;
+    slab_brk = heap + HEAP_SIZE;
+    slab_spare = NULL;
+    slab_page_count = 0;
+    for (int i = 0; i < SLAB_CLASSES; i++) {
+        slab_free[i] = NULL;
+        slab_empty[i] = 0;
+    }
+
+    mem_select_impl();
+
+    free_list = NULL;
+    arena_count = 0;
+    arena_bytes = 0;
+    arena_init(heap, HEAP_SIZE);
 }
 
-void* mem_alloc(size_t size) {
-    if (size == 0) return NULL;
-    
-    size = (size + 7) & ~7;
-    
-    block_t *current = head;
-    while (current) {
-        if (!current->used && current->size >= size) {
-            if (current->size >= size + sizeof(block_t) + 8) {
-                block_t *new = (block_t*)((uint8_t*)current + sizeof(block_t) + size);
-                new->size = current->size - size - sizeof(block_t);
-                new->used = 0;
-                new->next = current->next;
-                current->next = new;
-                current->size = size;
-            }
-            current->used = 1;
-            return (void*)((uint8_t*)current + sizeof(block_t));
+void mem_set_scrub_policy(int policy) {
+    scrub_policy = policy;
+}
+
+int mem_get_scrub_policy(void) {
+    return scrub_policy;
+}
+
+static void* block_alloc(size_t size) {
+    for (block_t *b = free_list; b; b = b->next) {
+        if (b->size < size) continue;
+
+        free_list_remove(b);
+        if (b->size >= size + BLOCK_OVERHEAD + 8) {
+            block_t *rest = (block_t*)((uint8_t*)b + BLOCK_OVERHEAD + size);
+            block_set(rest, b->size - size - BLOCK_OVERHEAD, 0);
+            free_list_insert(rest);
+            block_set(b, size, 1);
+        } else {
+            block_set(b, b->size, 1);
         }
-        current = current->next;
+
+        void *ptr = (uint8_t*)b + sizeof(block_t);
+        if (scrub_policy == MEM_SCRUB_ALLOC) mem_scrub(ptr, b->size / 4);
+        return ptr;
     }
-    
+
     return NULL;
 }
 
-void mem_free(void *ptr) {
-    if (!ptr) return;
-    
+static void* HOT_TEXT heap_alloc(size_t size) {
+    if (size <= SLAB_MAX) {
+        void *obj = slab_alloc(size);
+        if (obj) return obj;
+    }
+
+    size = (size + 7) & ~7;
+
+    void *ptr = block_alloc(size);
+    if (!ptr && heap_grow(size)) ptr = block_alloc(size);
+    return ptr;
+}
+
+static void HOT_TEXT heap_free(void *ptr) {
+    if (slab_owns(ptr)) {
+        slab_release(ptr);
+        return;
+    }
+
     block_t *block = (block_t*)((uint8_t*)ptr - sizeof(block_t));
-    
-    volatile uint8_t *vptr = (volatile uint8_t*)ptr;
-    for (size_t i = 0; i < block->size; i++) {
-        vptr[i] = 0;
+    if (scrub_policy == MEM_SCRUB_FREE) mem_scrub(ptr, block->size / 4);
+
+    size_t size = block->size;
+
+    block_t *next = block_next(block);
+    if (!next->used) {
+        free_list_remove(next);
+        size += BLOCK_OVERHEAD + next->size;
+        if (scrub_policy == MEM_SCRUB_FREE) {
+            mem_scrub(block_footer(block), BLOCK_OVERHEAD / 4);
+        }
     }
-    
-    block->used = 0;
-    
-    block_t *current = head;
-    while (current && current->next) {
-        if (!current->used && current->next && !current->next->used) {
-            current->size += sizeof(block_t) + current->next->size;
-            current->next = current->next->next;
-        } else {
-            current = current->next;
+
+    block_t *prev = block_prev(block);
+    if (prev && !prev->used) {
+        free_list_remove(prev);
+        size += BLOCK_OVERHEAD + prev->size;
+        if (scrub_policy == MEM_SCRUB_FREE) {
+            mem_scrub(block_footer(prev), BLOCK_OVERHEAD / 4);
         }
+        block = prev;
+    }
+
+    block_set(block, size, 0);
+
+    /* A page arena that is entirely free goes back to the page allocator. */
+    uint8_t *base = (uint8_t*)block - sizeof(block_tag_t);
+    if (base != heap && ((block_tag_t*)base)->size == 0 && block_next(block)->size == 0) {
+        arena_count--;
+        arena_bytes -= size + ARENA_OVERHEAD + BLOCK_OVERHEAD;
+        pmm_free(base);
+        return;
     }
+
+    free_list_insert(block);
 }
 
-void mem_copy(void *dst, const void *src, size_t n) {
-    uint8_t *d = (uint8_t*)dst;
-    const uint8_t *s = (const uint8_t*)src;
-    while (n--) {
-        *d++ = *s++;
+/* Allocator statistics. Every MEM_PROF_RATE-th allocation is sampled and
+ * charged to its caller's return address in a small open-addressed table. */
+#define MEM_PROF_RATE 8
+#define MEM_PROF_SITES 16
+
+typedef struct {
+    uint32_t bytes_in_use;
+    uint32_t peak_in_use;
+    uint32_t alloc_count;
+    uint32_t free_count;
+    uint32_t failed_count;
+    uint64_t alloc_cycles;
+    uint64_t free_cycles;
+} mem_stats_t;
+
+typedef struct {
+    uintptr_t site;
+    uint32_t samples;
+    uint32_t bytes;
+} mem_prof_site_t;
+
+static mem_stats_t stats;
+static spinlock_t heap_lock = SPINLOCK_INIT;
+static mem_prof_site_t prof_sites[MEM_PROF_SITES];
+static uint32_t prof_dropped = 0;
+
+static size_t mem_usable_size(void *ptr) {
+    if (slab_owns(ptr)) {
+        return (size_t)SLAB_MIN << (slab_page_of(ptr)->cls - 1);
     }
+    return ((block_t*)((uint8_t*)ptr - sizeof(block_t)))->size;
 }
 
-void mem_set(void *dst, uint8_t val, size_t n) {
-    uint8_t *d = (uint8_t*)dst;
-    while (n--) {
-        *d++ = val;
+static void prof_record(uintptr_t site, size_t size) {
+    uint32_t slot = (site >> 2) % MEM_PROF_SITES;
+    for (int i = 0; i < MEM_PROF_SITES; i++) {
+        mem_prof_site_t *ps = &prof_sites[(slot + i) % MEM_PROF_SITES];
+        if (ps->site == site || ps->site == 0) {
+            ps->site = site;
+            ps->samples++;
+            ps->bytes += size;
+            return;
+        }
+    }
+    prof_dropped++;
+}
+
+void* HOT_TEXT mem_alloc(size_t size) {
+    if (size == 0) return NULL;
+
+    spin_lock(&heap_lock);
+    uint64_t start = rdtsc();
+    void *ptr = heap_alloc(size);
+    stats.alloc_cycles += rdtsc() - start;
+
+    if (!ptr) {
+        stats.failed_count++;
+        spin_unlock(&heap_lock);
+        return NULL;
+    }
+
+    stats.alloc_count++;
+    stats.bytes_in_use += mem_usable_size(ptr);
+    if (stats.bytes_in_use > stats.peak_in_use) stats.peak_in_use = stats.bytes_in_use;
+
+    if (stats.alloc_count % MEM_PROF_RATE == 0) {
+        prof_record((uintptr_t)__builtin_return_address(0), size);
+    }
+    spin_unlock(&heap_lock);
+    return ptr;
+}
+
+void HOT_TEXT mem_free(void *ptr) {
+    if (!ptr) return;
+
+    spin_lock(&heap_lock);
+    uint64_t start = rdtsc();
+    stats.bytes_in_use -= mem_usable_size(ptr);
+    heap_free(ptr);
+    stats.free_cycles += rdtsc() - start;
+    stats.free_count++;
+    spin_unlock(&heap_lock);
+}
+
+static void mem_uint_to_str(uint32_t val, char *buf) {
+    if (val == 0) { buf[0] = '0'; buf[1] = 0; return; }
+    char tmp[12];
+    int len = 0;
+    while (val > 0) { tmp[len++] = '0' + (val % 10); val /= 10; }
+    for (int i = 0; i < len; i++) buf[i] = tmp[len - 1 - i];
+    buf[len] = 0;
+}
+
+static uint32_t mem_avg_cycles(uint64_t total, uint32_t count) {
+    if (count == 0) return 0;
+    while (total >> 32) {
+        total >>= 1;
+        count >>= 1;
+        if (count == 0) return 0xFFFFFFFF;
     }
+    return (uint32_t)total / count;
+}
+
+static void mem_print_stat(const char *label, uint32_t val, const char *unit) {
+    char line[80];
+    char numbuf[12];
+    shell_strcopy(line, label);
+    mem_uint_to_str(val, numbuf);
+    shell_strcopy(line + 20, numbuf);
+    if (unit) {
+        int len = shell_strlen(line);
+        shell_strcopy(line + len, unit);
+    }
+    shell_println(line, COLOR_FG);
+}
+
+void mem_show_stats(void) {
+    uint32_t free_blocks = 0, free_bytes = 0, largest = 0;
+    for (block_t *b = free_list; b; b = b->next) {
+        free_blocks++;
+        free_bytes += b->size;
+        if (b->size > largest) largest = b->size;
+    }
+
+    uint32_t slab_objs = 0;
+    for (int i = 0; i < SLAB_CLASSES; i++) {
+        for (slab_obj_t *o = slab_free[i]; o; o = o->next) slab_objs++;
+    }
+
+    shell_println("=== Heap ===", COLOR_TITLE);
+    mem_print_stat("  Heap size:        ", HEAP_SIZE + arena_bytes, " bytes");
+    mem_print_stat("  Page arenas:      ", arena_count, 0);
+    mem_print_stat("  In use:           ", stats.bytes_in_use, " bytes");
+    mem_print_stat("  Peak in use:      ", stats.peak_in_use, " bytes");
+    mem_print_stat("  Free blocks:      ", free_blocks, 0);
+    mem_print_stat("  Free bytes:       ", free_bytes, " bytes");
+    mem_print_stat("  Largest free:     ", largest, " bytes");
+    mem_print_stat("  Slab pages:       ", slab_page_count, 0);
+    mem_print_stat("  Free slab objs:   ", slab_objs, 0);
+    mem_print_stat("  Allocations:      ", stats.alloc_count, 0);
+    mem_print_stat("  Frees:            ", stats.free_count, 0);
+    mem_print_stat("  Failed allocs:    ", stats.failed_count, 0);
+    mem_print_stat("  Avg alloc:        ", mem_avg_cycles(stats.alloc_cycles, stats.alloc_count + stats.failed_count), " cycles");
+    mem_print_stat("  Avg free:         ", mem_avg_cycles(stats.free_cycles, stats.free_count), " cycles");
+
+    char line[80];
+    shell_strcopy(line, "  Copy engine:      ");
+    shell_strcopy(line + 20, copy_impl_name);
+    shell_println(line, COLOR_INFO);
+
+    const char *policy = "none";
+    if (scrub_policy == MEM_SCRUB_ALLOC) policy = "on alloc";
+    else if (scrub_policy == MEM_SCRUB_FREE) policy = "on free (rep stosd)";
+    shell_strcopy(line, "  Scrub policy:     ");
+    shell_strcopy(line + 20, policy);
+    shell_println(line, COLOR_INFO);
+}
+
+void mem_show_profile(void) {
+    char line[80];
+    char numbuf[12];
+
+    shell_println("=== Heap Profile (1 in 8 allocs sampled) ===", COLOR_TITLE);
+    shell_println("  Call site     Samples   Est. bytes", COLOR_INFO);
+
+    uint8_t shown[MEM_PROF_SITES];
+    for (int i = 0; i < MEM_PROF_SITES; i++) shown[i] = 0;
+
+    int printed = 0;
+    for (int n = 0; n < MEM_PROF_SITES; n++) {
+        int best = -1;
+        for (int i = 0; i < MEM_PROF_SITES; i++) {
+            if (shown[i] || prof_sites[i].site == 0) continue;
+            if (best < 0 || prof_sites[i].samples > prof_sites[best].samples) best = i;
+        }
+        if (best < 0) break;
+        shown[best] = 1;
+
+        for (int i = 0; i < 40; i++) line[i] = ' ';
+        shell_int_to_hex(prof_sites[best].site, line + 2, 8);
+        line[12] = ' ';
+        mem_uint_to_str(prof_sites[best].samples, numbuf);
+        for (int i = 0; numbuf[i]; i++) line[16 + i] = numbuf[i];
+        mem_uint_to_str(prof_sites[best].bytes * MEM_PROF_RATE, numbuf);
+        shell_strcopy(line + 26, numbuf);
+        shell_println(line, COLOR_FG);
+        printed++;
+    }
+
+    if (!printed) shell_println("  No samples yet.", COLOR_INFO);
+    if (prof_dropped) mem_print_stat("  Dropped samples:  ", prof_dropped, 0);
 }
 
 void mem_wipe_all(void) {
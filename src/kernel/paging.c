@@ -0,0 +1,213 @@
+#include "types.h"
+#include "paging.h"
+#include "pmm.h"
+#include "shell.h"
+#include "sched.h"
+
+extern uint8_t __text_start[], __rodata_end[];
+
+/* Everything is identity mapped. 4 MB pages cover all of the address
+ * space; a directory entry is split into a 4 KB table only where a range
+ * needs finer protection (low 4 MB, demand-zero regions). */
+#define PAGING_MAX_LAZY 8
+
+typedef struct {
+    uintptr_t start;
+    uintptr_t end;
+} lazy_range_t;
+
+static uint32_t page_dir[1024] __attribute__((aligned(4096)));
+static uint32_t low_table[1024] __attribute__((aligned(4096)));
+static lazy_range_t lazy_ranges[PAGING_MAX_LAZY];
+static int lazy_count = 0;
+static uint32_t global_flag = 0;
+static uint32_t split_tables = 0;
+static uint32_t demand_faults = 0;
+static uint32_t stale_faults = 0;
+static spinlock_t paging_lock = SPINLOCK_INIT;
+/* A demand-zero page is cleared through this window, under paging_lock,
+ * before it is mapped: once present, another CPU could write to it. The
+ * window's own frame is never used. */
+static uint8_t zero_window[0x1000] __attribute__((aligned(4096)));
+
+static inline void invlpg(uintptr_t addr) {
+    __asm__ volatile ("invlpg (%0)" : : "r"(addr) : "memory");
+}
+
+static uint32_t* paging_table(uintptr_t addr) {
+    uint32_t pde = page_dir[addr >> 22];
+    if (!(pde & PG_PSE)) return (uint32_t*)(pde & ~0xFFF);
+
+    uint32_t *table = pmm_alloc(0);
+    if (!table) return NULL;
+
+    uint32_t base = pde & 0xFFC00000;
+    uint32_t flags = (pde & (PG_WRITE | PG_PWT | PG_PCD | PG_GLOBAL)) | PG_PRESENT;
+    for (int i = 0; i < 1024; i++) {
+        table[i] = (base + ((uint32_t)i << 12)) | flags;
+    }
+    page_dir[addr >> 22] = (uint32_t)table | PG_PRESENT | PG_WRITE;
+    split_tables++;
+
+    /* The old 4 MB entry may be cached as a single TLB entry. It is
+     * global, so reloading CR3 would keep it; invlpg drops it. */
+    invlpg(base);
+    return table;
+}
+
+void paging_init(void) {
+    uint32_t eax = 1, ebx, ecx, edx;
+    __asm__ volatile ("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+    if (edx & (1 << 13)) global_flag = PG_GLOBAL;
+
+    for (int i = 0; i < 1024; i++) {
+        page_dir[i] = ((uint32_t)i << 22) | PG_PRESENT | PG_WRITE | PG_PSE | global_flag;
+    }
+
+    /* Low 4 MB: page 0 unmapped to catch NULL, kernel text and rodata
+     * read-only, one unmapped page below the stack. */
+    uintptr_t ro_start = (uintptr_t)__text_start & ~0xFFF;
+    uintptr_t ro_end = (uintptr_t)__rodata_end & ~0xFFF;
+    for (int i = 0; i < 1024; i++) {
+        uintptr_t addr = (uintptr_t)i << 12;
+        uint32_t flags = PG_PRESENT | PG_WRITE | global_flag;
+        if (addr >= ro_start && addr < ro_end) flags &= ~PG_WRITE;
+        if (addr == 0 || addr == STACK_GUARD) flags = 0;
+        low_table[i] = addr | flags;
+    }
+    page_dir[0] = (uint32_t)low_table | PG_PRESENT | PG_WRITE;
+    lazy_count = 0;
+
+    uint32_t cr0, cr4;
+    __asm__ volatile ("mov %%cr4, %0" : "=r"(cr4));
+    cr4 |= 1 << 4;
+    if (global_flag) cr4 |= 1 << 7;
+    __asm__ volatile ("mov %0, %%cr4" : : "r"(cr4));
+    __asm__ volatile ("mov %0, %%cr3" : : "r"(page_dir) : "memory");
+    __asm__ volatile ("mov %%cr0, %0" : "=r"(cr0));
+    cr0 |= (1u << 31) | (1 << 16);
+    __asm__ volatile ("mov %0, %%cr0" : : "r"(cr0) : "memory");
+}
+
+/* Taking away access (present or writable) flushes the range from every
+ * CPU's TLB before returning, so callers must have interrupts on and hold
+ * no lock that is taken with interrupts off. Granting access only flushes
+ * the local TLB: another CPU may keep the old, stricter entry, and the
+ * fault handler then finds the new one and just flushes. */
+int paging_set_flags(uintptr_t addr, size_t size, uint32_t set, uint32_t clear) {
+    uintptr_t start = addr & ~0xFFF, end = addr + size;
+    int removed = 0, ret = 0;
+    spin_lock(&paging_lock);
+    for (uintptr_t page = start; page < end; page += 0x1000) {
+        uint32_t *table = paging_table(page);
+        if (!table) {
+            end = page;
+            ret = -1;
+            break;
+        }
+        uint32_t *pte = &table[(page >> 12) & 0x3FF];
+        if ((*pte & PG_PRESENT) && (*pte & clear & (PG_PRESENT | PG_WRITE))) removed = 1;
+        *pte = (*pte & ~clear) | set;
+        invlpg(page);
+    }
+    spin_unlock(&paging_lock);
+    if (removed) smp_flush_tlb(start, end);
+    return ret;
+}
+
+/* Whether the current entries allow the access that faulted. */
+static int paging_allows(uint32_t addr, uint32_t err) {
+    uint32_t need = PG_PRESENT | ((err & PF_WRITE) ? PG_WRITE : 0);
+    uint32_t pde = page_dir[addr >> 22];
+    if ((pde & need) != need) return 0;
+    if (pde & PG_PSE) return 1;
+    uint32_t pte = ((uint32_t*)(pde & ~0xFFF))[(addr >> 12) & 0x3FF];
+    return (pte & need) == need;
+}
+
+/* Registering a range that is already demand-zero just drops its pages
+ * again, so the next touch sees fresh zeroes. */
+int paging_demand_zero(uintptr_t addr, size_t size) {
+    int known = 0;
+    spin_lock(&paging_lock);
+    for (int i = 0; i < lazy_count; i++) {
+        if (addr >= lazy_ranges[i].start && addr + size <= lazy_ranges[i].end) known = 1;
+    }
+    if (!known) {
+        if (lazy_count >= PAGING_MAX_LAZY) {
+            spin_unlock(&paging_lock);
+            return -1;
+        }
+        lazy_ranges[lazy_count].start = addr & ~0xFFF;
+        lazy_ranges[lazy_count].end = addr + size;
+        lazy_count++;
+    }
+    spin_unlock(&paging_lock);
+    /* Registered first, so a fault on a page just unmapped finds it. */
+    return paging_set_flags(addr, size, 0, PG_PRESENT);
+}
+
+int paging_handle_fault(uint32_t addr, uint32_t err) {
+    spin_lock(&paging_lock);
+    if (paging_allows(addr, err)) {
+        invlpg(addr & ~0xFFF);
+        stale_faults++;
+        spin_unlock(&paging_lock);
+        return 1;
+    }
+    if (err & PF_PRESENT) {
+        spin_unlock(&paging_lock);
+        return 0;
+    }
+
+    for (int i = 0; i < lazy_count; i++) {
+        if (addr < lazy_ranges[i].start || addr >= lazy_ranges[i].end) continue;
+
+        uintptr_t page = addr & ~0xFFF;
+        uint32_t *win = &low_table[(uintptr_t)zero_window >> 12];
+        uint32_t identity = *win;
+        *win = page | PG_PRESENT | PG_WRITE;
+        invlpg((uintptr_t)zero_window);
+        void *dst = zero_window;
+        size_t n = 1024;
+        __asm__ volatile ("rep stosl" : "+D"(dst), "+c"(n) : "a"(0) : "memory");
+        *win = identity;
+        invlpg((uintptr_t)zero_window);
+
+        uint32_t *table = (uint32_t*)(page_dir[page >> 22] & ~0xFFF);
+        table[(page >> 12) & 0x3FF] |= PG_PRESENT | PG_WRITE;
+        invlpg(page);
+        demand_faults++;
+        spin_unlock(&paging_lock);
+        return 1;
+    }
+    spin_unlock(&paging_lock);
+    return 0;
+}
+
+const char* paging_fault_reason(uint32_t addr, uint32_t err) {
+    if (addr < 0x1000) return "NULL pointer dereference";
+    if ((addr & ~0xFFF) == STACK_GUARD || sched_stack_guard(addr)) return "Stack overflow";
+    if ((err & PF_PRESENT) && (err & PF_WRITE)) return "Write to read-only page";
+    return "Page fault";
+}
+
+static void paging_print_stat(const char *label, uint32_t val) {
+    char line[60];
+    char tmp[12];
+    int len = 0;
+    shell_strcopy(line, label);
+    do { tmp[len++] = '0' + (val % 10); val /= 10; } while (val);
+    int pos = 20;
+    while (len) line[pos++] = tmp[--len];
+    line[pos] = 0;
+    shell_println(line, COLOR_FG);
+}
+
+void paging_show_info(void) {
+    shell_println("Paging:", COLOR_INFO);
+    paging_print_stat("  4 KB tables:      ", split_tables + 1);
+    paging_print_stat("  Demand regions:   ", lazy_count);
+    paging_print_stat("  Demand faults:    ", demand_faults);
+    paging_print_stat("  Stale TLB faults: ", stale_faults);
+}
@@ -0,0 +1,266 @@
+#include "types.h"
+#include "pmm.h"
+#include "shell.h"
+#include "sched.h"
+
+extern uint8_t __bss_end[];
+extern void mem_set(void *dst, uint8_t val, size_t n);
+
+/* Per-frame state: the head frame of a block records its order, the
+ * frames inside a block are left at 0. */
+#define FRAME_RESERVED 0xFF
+#define FRAME_FREE 0x80
+#define FRAME_USED 0x40
+#define FRAME_ORDER 0x0F
+
+#define PMM_LOW_LIMIT 0x100000
+#define PMM_FALLBACK_TOP 0x1000000
+#define PMM_ADDR_LIMIT 0x100000000ULL
+
+typedef struct free_page {
+    struct free_page *prev;
+    struct free_page *next;
+} free_page_t;
+
+static uint8_t *frame_state = NULL;
+static uint32_t frame_count = 0;
+static free_page_t *free_area[PMM_MAX_ORDER + 1];
+static uint32_t free_area_count[PMM_MAX_ORDER + 1];
+static uint32_t total_pages = 0;
+static uint32_t free_pages = 0;
+static spinlock_t pmm_lock = SPINLOCK_INIT;
+static e820_entry_t e820_map[E820_MAX];
+static uint32_t e820_count = 0;
+
+static void area_push(uint32_t pfn, uint32_t order) {
+    free_page_t *page = (free_page_t*)(pfn << PAGE_SHIFT);
+    page->prev = NULL;
+    page->next = free_area[order];
+    if (free_area[order]) free_area[order]->prev = page;
+    free_area[order] = page;
+    free_area_count[order]++;
+}
+
+static void area_remove(uint32_t pfn, uint32_t order) {
+    free_page_t *page = (free_page_t*)(pfn << PAGE_SHIFT);
+    if (page->prev) page->prev->next = page->next;
+    else free_area[order] = page->next;
+    if (page->next) page->next->prev = page->prev;
+    free_area_count[order]--;
+}
+
+static void mark_range(uint64_t start, uint64_t end, uint8_t state) {
+    if (start >= PMM_ADDR_LIMIT) return;
+    if (end > PMM_ADDR_LIMIT) end = PMM_ADDR_LIMIT;
+
+    uint32_t first, last;
+    if (state == FRAME_RESERVED) {
+        first = (uint32_t)(start >> PAGE_SHIFT);
+        last = (uint32_t)((end + PAGE_SIZE - 1) >> PAGE_SHIFT);
+    } else {
+        first = (uint32_t)((start + PAGE_SIZE - 1) >> PAGE_SHIFT);
+        last = (uint32_t)(end >> PAGE_SHIFT);
+    }
+    if (last > frame_count) last = frame_count;
+    for (uint32_t pfn = first; pfn < last; pfn++) {
+        frame_state[pfn] = state;
+    }
+}
+
+void pmm_init(void) {
+    /* Keep a copy so page 0 can be unmapped once paging is on. */
+    uint32_t count = *(volatile uint32_t*)phys_ptr(E820_COUNT_ADDR);
+    if (count > E820_MAX) count = 0;
+    e820_count = count;
+    for (uint32_t i = 0; i < count; i++) {
+        e820_map[i] = ((e820_entry_t*)phys_ptr(E820_MAP_ADDR))[i];
+    }
+    e820_entry_t *map = e820_map;
+
+    uint64_t top = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (map[i].type != E820_USABLE) continue;
+        uint64_t end = map[i].base + map[i].length;
+        if (end > PMM_ADDR_LIMIT) end = PMM_ADDR_LIMIT;
+        if (end > top) top = end;
+    }
+    if (top == 0) top = PMM_FALLBACK_TOP;
+    frame_count = (uint32_t)(top >> PAGE_SHIFT);
+
+    for (int i = 0; i <= PMM_MAX_ORDER; i++) {
+        free_area[i] = NULL;
+        free_area_count[i] = 0;
+    }
+
+    /* The frame table sits directly after the kernel BSS. */
+    uintptr_t meta = ((uintptr_t)__bss_end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    frame_state = (uint8_t*)meta;
+    mem_set(frame_state, FRAME_RESERVED, frame_count);
+
+    if (count == 0) {
+        mark_range(PMM_LOW_LIMIT, top, FRAME_USED);
+    } else {
+        for (uint32_t i = 0; i < count; i++) {
+            if (map[i].type == E820_USABLE)
+                mark_range(map[i].base, map[i].base + map[i].length, FRAME_USED);
+        }
+        for (uint32_t i = 0; i < count; i++) {
+            if (map[i].type != E820_USABLE)
+                mark_range(map[i].base, map[i].base + map[i].length, FRAME_RESERVED);
+        }
+    }
+
+    mark_range(0, meta + frame_count, FRAME_RESERVED);
+    mark_range(XFCE_PRELOAD_BASE, XFCE_PRELOAD_BASE + XFCE_PRELOAD_SIZE, FRAME_RESERVED);
+
+    total_pages = 0;
+    free_pages = 0;
+    for (uint32_t pfn = 0; pfn < frame_count; pfn++) {
+        if (frame_state[pfn] != FRAME_USED) continue;
+        total_pages++;
+        pmm_free((void*)(pfn << PAGE_SHIFT));
+    }
+}
+
+void* pmm_alloc(uint32_t order) {
+    if (order > PMM_MAX_ORDER) return NULL;
+
+    spin_lock(&pmm_lock);
+    uint32_t o = order;
+    while (o <= PMM_MAX_ORDER && !free_area[o]) o++;
+    if (o > PMM_MAX_ORDER) {
+        spin_unlock(&pmm_lock);
+        return NULL;
+    }
+
+    uint32_t pfn = (uintptr_t)free_area[o] >> PAGE_SHIFT;
+    area_remove(pfn, o);
+
+    while (o > order) {
+        o--;
+        uint32_t buddy = pfn + (1u << o);
+        frame_state[buddy] = FRAME_FREE | o;
+        area_push(buddy, o);
+    }
+
+    frame_state[pfn] = FRAME_USED | order;
+    free_pages -= 1u << order;
+    spin_unlock(&pmm_lock);
+    return (void*)(pfn << PAGE_SHIFT);
+}
+
+void pmm_free(void *addr) {
+    uint32_t pfn = (uintptr_t)addr >> PAGE_SHIFT;
+    if (!addr || pfn >= frame_count) return;
+
+    spin_lock(&pmm_lock);
+    uint8_t state = frame_state[pfn];
+    if (state == FRAME_RESERVED || !(state & FRAME_USED)) {
+        spin_unlock(&pmm_lock);
+        return;
+    }
+
+    uint32_t order = state & FRAME_ORDER;
+    free_pages += 1u << order;
+    frame_state[pfn] = 0;
+
+    while (order < PMM_MAX_ORDER) {
+        uint32_t buddy = pfn ^ (1u << order);
+        if (buddy >= frame_count || frame_state[buddy] != (FRAME_FREE | order)) break;
+        area_remove(buddy, order);
+        frame_state[buddy] = 0;
+        pfn &= ~(1u << order);
+        order++;
+    }
+
+    frame_state[pfn] = FRAME_FREE | order;
+    area_push(pfn, order);
+    spin_unlock(&pmm_lock);
+}
+
+uint32_t pmm_order_for(size_t bytes) {
+    uint32_t order = 0;
+    while (order < PMM_MAX_ORDER && ((uint32_t)PAGE_SIZE << order) < bytes) order++;
+    return order;
+}
+
+/* Frames from 0 to the top of usable memory, usable or not. */
+uint32_t pmm_frame_count(void) {
+    return frame_count;
+}
+
+uint32_t pmm_total_pages(void) {
+    return total_pages;
+}
+
+uint32_t pmm_free_pages(void) {
+    return free_pages;
+}
+
+static void pmm_uint_to_str(uint32_t val, char *buf) {
+    if (val == 0) { buf[0] = '0'; buf[1] = 0; return; }
+    char tmp[12];
+    int len = 0;
+    while (val > 0) { tmp[len++] = '0' + (val % 10); val /= 10; }
+    for (int i = 0; i < len; i++) buf[i] = tmp[len - 1 - i];
+    buf[len] = 0;
+}
+
+void pmm_show_info(void) {
+    char line[80];
+    char numbuf[12];
+
+    shell_println("Physical memory:", COLOR_INFO);
+
+    shell_strcopy(line, "  Usable:           ");
+    pmm_uint_to_str(total_pages * (PAGE_SIZE / 1024), numbuf);
+    shell_strcopy(line + 20, numbuf);
+    shell_strcopy(line + shell_strlen(line), " KB");
+    shell_println(line, COLOR_FG);
+
+    shell_strcopy(line, "  Free:             ");
+    pmm_uint_to_str(free_pages * (PAGE_SIZE / 1024), numbuf);
+    shell_strcopy(line + 20, numbuf);
+    shell_strcopy(line + shell_strlen(line), " KB");
+    shell_println(line, COLOR_FG);
+
+    shell_strcopy(line, "  Free blocks:      ");
+    int pos = 20;
+    for (int i = 0; i <= PMM_MAX_ORDER; i++) {
+        pmm_uint_to_str(free_area_count[i], numbuf);
+        for (int j = 0; numbuf[j] && pos < 78; j++) line[pos++] = numbuf[j];
+        if (i < PMM_MAX_ORDER) line[pos++] = ' ';
+    }
+    line[pos] = 0;
+    shell_println(line, COLOR_FG);
+    shell_println("                    (order 0 = 4 KB ... 10 = 4 MB)", COLOR_INFO);
+}
+
+static void pmm_hex64(uint64_t val, char *buf) {
+    char low[12];
+    shell_int_to_hex((uint32_t)(val >> 32), buf, 8);
+    shell_int_to_hex((uint32_t)val, low, 8);
+    shell_strcopy(buf + 10, low + 2);
+}
+
+void pmm_show_map(void) {
+    uint32_t count = e820_count;
+    e820_entry_t *map = e820_map;
+    char line[80];
+
+    if (count == 0) {
+        shell_println("No E820 map from BIOS, assuming 16 MB.", COLOR_ERROR);
+        return;
+    }
+
+    shell_println("E820 memory map:", COLOR_INFO);
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t end = map[i].base + map[i].length - 1;
+        shell_strcopy(line, "  ");
+        pmm_hex64(map[i].base, line + 2);
+        shell_strcopy(line + 20, " - ");
+        pmm_hex64(end, line + 23);
+        shell_strcopy(line + 41, map[i].type == E820_USABLE ? "  usable" : "  reserved");
+        shell_println(line, map[i].type == E820_USABLE ? COLOR_FG : COLOR_INFO);
+    }
+}
@@ -0,0 +1,601 @@
+#include "types.h"
+#include "sched.h"
+#include "timer.h"
+#include "pmm.h"
+#include "paging.h"
+#include "shell.h"
+
+extern int fb_selected(void);
+extern void mem_copy(void *dst, const void *src, size_t n);
+extern uint64_t clock_cycles_to_ns(uint64_t cycles);
+extern uint64_t clock_div(uint64_t n, uint32_t d, uint32_t *rem);
+
+/* Preemptive kernel threads on every CPU. Each thread has its own stack
+ * with an unmapped guard page at the bottom; kmain becomes thread 0 on
+ * the boot stack and each CPU gets an idle thread. A thread that is
+ * switched out keeps its callee-saved registers on its own stack, and an
+ * interrupted thread also keeps the interrupt frame there, so the
+ * interrupt returns whenever the thread is picked again.
+ *
+ * Each CPU has its own run queue, a FIFO per priority, and the best
+ * non-empty one wins. A CPU whose queue is empty steals the oldest
+ * thread of the best priority from another CPU before it idles, and a
+ * thread queued behind a busy CPU wakes an idle one to come and steal it.
+ * Woken threads go back to the CPU they last ran on. kmain is pinned to
+ * the boot CPU, which takes all device interrupts.
+ *
+ * Switches happen on the way out of an interrupt (sched_irq_exit), when a
+ * thread blocks or yields, or when preemption is enabled again with a
+ * switch pending. A thread woken with a better priority than the running
+ * one preempts it, through a reschedule IPI if it is on another CPU;
+ * threads of equal priority get SCHED_SLICE_MS each, timed on the timer
+ * wheel only while there is someone to rotate with.
+ *
+ * Per thread state that is not on the stack: the x87/SSE registers
+ * (fxsave, since mem_copy and the graphics console use XMM registers)
+ * and the selected framebuffer screen, which framebuffer.c reads from
+ * the running thread. */
+#define THREAD_STACK_SIZE 0x8000
+#define SCHED_SLICE_MS 10
+#define EFLAGS_IF 0x200
+
+/* lock guards the queues and every switch on its CPU: it is taken before
+ * the running thread is put back or blocked and released by the thread
+ * switched to, so no other CPU picks a thread whose registers are still
+ * being saved. */
+typedef struct {
+    spinlock_t lock;
+    thread_t *head[SCHED_PRIOS];
+    thread_t *tail[SCHED_PRIOS];
+    volatile uint32_t ready;
+    thread_t *idle;
+    thread_t *prev;
+    timer_t slice;
+    uint64_t switched_at;
+    uint32_t switches;
+    uint32_t steals;
+} runq_t;
+
+static thread_t threads[SCHED_MAX_THREADS];
+static runq_t runqs[SMP_MAX_CPUS];
+static spinlock_t threads_lock = SPINLOCK_INIT;
+static int has_fxsr = 0;
+static uint8_t fpu_init_state[512] __attribute__((aligned(16)));
+static uint32_t next_id = 0;
+
+static void sched_finish(void);
+
+/* Saves ebp, ebx, esi and edi on the old stack, stores esp in *old_esp,
+ * then loads new_esp and pops the same registers from there. */
+__asm__(
+    ".globl sched_switch\n"
+    "sched_switch:\n"
+    "   mov 4(%esp), %eax\n"
+    "   mov 8(%esp), %edx\n"
+    "   push %ebp\n"
+    "   push %ebx\n"
+    "   push %esi\n"
+    "   push %edi\n"
+    "   mov %esp, (%eax)\n"
+    "   mov %edx, %esp\n"
+    "   pop %edi\n"
+    "   pop %esi\n"
+    "   pop %ebx\n"
+    "   pop %ebp\n"
+    "   ret\n"
+);
+extern void sched_switch(uint32_t *old_esp, uint32_t new_esp);
+
+static inline uint32_t irq_save(void) {
+    uint32_t flags;
+    __asm__ volatile ("pushf\npop %0\ncli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+static inline void irq_restore(uint32_t flags) {
+    __asm__ volatile ("push %0\npopf" : : "r"(flags) : "memory", "cc");
+}
+
+/* One read, so it cannot mix up two CPUs if the thread migrates. */
+static inline thread_t* sched_running(void) {
+    thread_t *t;
+    __asm__ volatile ("mov %%gs:%c1, %0" : "=r"(t) : "i"(__builtin_offsetof(cpu_t, current)));
+    return t;
+}
+
+static void runq_push(runq_t *rq, thread_t *t) {
+    t->next = NULL;
+    if (rq->tail[t->prio]) rq->tail[t->prio]->next = t;
+    else rq->head[t->prio] = t;
+    rq->tail[t->prio] = t;
+    rq->ready++;
+}
+
+/* A thief skips pinned threads. */
+static thread_t* runq_pop(runq_t *rq, int stealing) {
+    for (int prio = 0; prio < SCHED_PRIOS; prio++) {
+        thread_t **link = &rq->head[prio], *prev = NULL;
+        while (*link && stealing && (*link)->pinned) {
+            prev = *link;
+            link = &prev->next;
+        }
+        thread_t *t = *link;
+        if (!t) continue;
+        *link = t->next;
+        if (rq->tail[prio] == t) rq->tail[prio] = prev;
+        rq->ready--;
+        return t;
+    }
+    return NULL;
+}
+
+/* Makes cpu reschedule on its next interrupt exit, sending it an IPI if
+ * it is not this one. */
+static void sched_kick(uint32_t cpu) {
+    smp_cpu(cpu)->need_resched = 1;
+    if (cpu != smp_cpu_id()) smp_send_ipi(cpu, SMP_RESCHED_VECTOR);
+}
+
+static void sched_slice_end(void *arg) {
+    sched_kick((uint32_t)arg);
+}
+
+/* Queue t on its CPU, whose lock is held. A thread that has to wait
+ * there wakes an idle CPU to steal it. */
+static void sched_enqueue(runq_t *rq, thread_t *t) {
+    t->state = THREAD_READY;
+    runq_push(rq, t);
+    thread_t *running = smp_cpu(t->cpu)->current;
+    if (t->prio < running->prio) {
+        sched_kick(t->cpu);
+        return;
+    }
+    if (t->prio == running->prio && !timer_pending(&rq->slice))
+        timer_arm(&rq->slice, SCHED_SLICE_MS);
+    if (t->pinned) return;
+
+    uint32_t count = smp_cpu_count();
+    for (uint32_t i = 1; i < count; i++) {
+        uint32_t cpu = (t->cpu + i) % count;
+        if (smp_cpu(cpu)->current == runqs[cpu].idle) {
+            sched_kick(cpu);
+            return;
+        }
+    }
+}
+
+/* trylock only, since the other CPU may be stealing from this one. */
+static thread_t* sched_steal(uint32_t self) {
+    uint32_t count = smp_cpu_count();
+    for (uint32_t i = 1; i < count; i++) {
+        runq_t *rq = &runqs[(self + i) % count];
+        if (!rq->ready || !ticket_trylock(&rq->lock)) continue;
+        thread_t *t = runq_pop(rq, 1);
+        if (t) t->cpu = self;
+        ticket_unlock(&rq->lock);
+        if (t) {
+            runqs[self].steals++;
+            return t;
+        }
+    }
+    return NULL;
+}
+
+/* Interrupts off and this CPU's queue locked. The idle thread is always
+ * runnable, so there is always a next thread. */
+static void HOT_TEXT schedule_locked(runq_t *rq) {
+    cpu_t *cpu = smp_this_cpu();
+    thread_t *prev = cpu->current;
+    if (prev->state == THREAD_RUNNING) {
+        prev->state = THREAD_READY;
+        if (prev != rq->idle) runq_push(rq, prev);
+    }
+    thread_t *next = runq_pop(rq, 0);
+    if (!next) next = sched_steal(cpu->id);
+    if (!next) next = rq->idle;
+    cpu->need_resched = 0;
+    next->state = THREAD_RUNNING;
+
+    if (!rq->head[next->prio]) timer_cancel(&rq->slice);
+    else if (next != prev || !timer_pending(&rq->slice)) timer_arm(&rq->slice, SCHED_SLICE_MS);
+    if (next == prev) {
+        ticket_unlock(&rq->lock);
+        return;
+    }
+
+    uint64_t now = rdtsc();
+    prev->cycles += now - rq->switched_at;
+    rq->switched_at = now;
+    next->switches++;
+    rq->switches++;
+
+    if (has_fxsr) {
+        __asm__ volatile ("fxsave %0" : "=m"(prev->fpu));
+        __asm__ volatile ("fxrstor %0" : : "m"(next->fpu));
+    }
+
+    rq->prev = prev;
+    cpu->current = next;
+    sched_switch(&prev->esp, next->esp);
+    sched_finish();
+}
+
+static void HOT_TEXT schedule(void) {
+    runq_t *rq = &runqs[smp_cpu_id()];
+    ticket_lock(&rq->lock);
+    schedule_locked(rq);
+}
+
+/* Completes a switch, in the thread switched to and on its CPU, which
+ * need not be the one it last left. */
+static void sched_finish(void) {
+    runq_t *rq = &runqs[smp_cpu_id()];
+    if (rq->prev->state == THREAD_EXITING) rq->prev->state = THREAD_FREE;
+    ticket_unlock(&rq->lock);
+}
+
+static void sched_idle(void *arg) {
+    (void)arg;
+    for (;;) __asm__ volatile ("sti\nhlt");
+}
+
+/* First code run by a new thread, entered from sched_switch. */
+static void thread_start(thread_t *t) {
+    sched_finish();
+    __asm__ volatile ("sti");
+    t->fn(t->arg);
+    thread_exit();
+}
+
+/* A free slot with a stack, threads_lock held. Stacks are kept with
+ * their slot when a thread exits and reused by the next one. The guard
+ * page is unmapped by thread_guard once the lock is dropped, since that
+ * may have to wait for the other CPUs to flush their TLBs. */
+static thread_t* thread_alloc(void) {
+    thread_t *t = NULL;
+    for (int i = 0; i < SCHED_MAX_THREADS; i++) {
+        if (threads[i].state == THREAD_FREE) {
+            t = &threads[i];
+            break;
+        }
+    }
+    if (t && !t->stack) {
+        t->stack = pmm_alloc(pmm_order_for(THREAD_STACK_SIZE));
+    }
+    if (!t || !t->stack) return NULL;
+    return t;
+}
+
+/* Does nothing for a reused stack, whose guard page is still unmapped. */
+static void thread_guard(thread_t *t) {
+    paging_set_flags((uintptr_t)t->stack, PAGE_SIZE, 0, PG_PRESENT);
+}
+
+/* The new thread starts on the caller's CPU with its selected screen. */
+static void thread_init(thread_t *t, const char *name, void (*fn)(void *arg), void *arg, int prio) {
+    uint32_t *sp = (uint32_t*)(t->stack + THREAD_STACK_SIZE);
+    *--sp = (uint32_t)t;                /* thread_start argument */
+    *--sp = 0;                          /* its return address */
+    *--sp = (uint32_t)thread_start;
+    for (int i = 0; i < 4; i++) *--sp = 0;
+    t->esp = (uint32_t)sp;
+
+    if (has_fxsr) mem_copy(t->fpu, fpu_init_state, sizeof(t->fpu));
+    t->fn = fn;
+    t->arg = arg;
+    t->name = name;
+    t->id = next_id++;
+    t->prio = prio;
+    t->screen = fb_selected();
+    t->cpu = smp_cpu_id();
+    t->pinned = 0;
+    t->wake_pending = 0;
+    t->waiting = 0;
+    t->switches = 0;
+    t->cycles = 0;
+    t->recover = NULL;
+    t->state = THREAD_READY;
+}
+
+/* Must run after mem_init and fb_init, which may enable SSE; new threads
+ * start from the FPU state taken here. */
+void sched_init(void) {
+    uint32_t eax = 1, ebx, ecx, edx;
+    __asm__ volatile ("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+    has_fxsr = (edx >> 24) & 1;
+    if (has_fxsr) {
+        __asm__ volatile ("fninit\nfxsave %0" : "=m"(fpu_init_state));
+    }
+    for (uint32_t i = 0; i < SMP_MAX_CPUS; i++) {
+        timer_setup(&runqs[i].slice, sched_slice_end, (void*)i);
+    }
+
+    cpu_t *cpu = smp_this_cpu();
+    thread_t *t = &threads[0];
+    t->name = "kmain";
+    t->id = next_id++;
+    t->prio = SCHED_PRIO_UI;
+    t->state = THREAD_RUNNING;
+    t->screen = fb_selected();
+    t->cpu = cpu->id;
+    t->pinned = 1;
+    cpu->current = t;
+    runqs[cpu->id].switched_at = rdtsc();
+
+    sched_add_cpu(cpu->id);
+}
+
+/* Sets up a CPU's idle thread. The boot CPU switches to it like to any
+ * other thread; an AP starts out on its stack, whose top is returned, and
+ * enters it with sched_cpu_start. 0 if there is no free slot. */
+uint32_t sched_add_cpu(uint32_t cpu) {
+    runq_t *rq = &runqs[cpu];
+    if (!rq->idle) {
+        uint32_t flags = spin_lock_irqsave(&threads_lock);
+        thread_t *t = thread_alloc();
+        if (t) thread_init(t, "idle", sched_idle, NULL, SCHED_PRIO_IDLE);
+        spin_unlock_irqrestore(&threads_lock, flags);
+        if (!t) return 0;
+        thread_guard(t);
+        t->cpu = cpu;
+        t->pinned = 1;
+        rq->idle = t;
+    }
+    if (cpu != smp_cpu_id()) {
+        rq->idle->state = THREAD_RUNNING;
+        smp_cpu(cpu)->current = rq->idle;
+    }
+    return (uint32_t)rq->idle->stack + THREAD_STACK_SIZE;
+}
+
+/* Called by a started AP once it can take interrupts. */
+void sched_cpu_start(void) {
+    runqs[smp_cpu_id()].switched_at = rdtsc();
+    sched_idle(NULL);
+    __builtin_unreachable();
+}
+
+thread_t* thread_create(const char *name, void (*fn)(void *arg), void *arg, int prio) {
+    uint32_t flags = spin_lock_irqsave(&threads_lock);
+    thread_t *t = thread_alloc();
+    if (t) thread_init(t, name, fn, arg, prio);
+    spin_unlock_irqrestore(&threads_lock, flags);
+    if (!t) return NULL;
+    thread_guard(t);
+
+    runq_t *rq = &runqs[t->cpu];
+    flags = spin_lock_irqsave(&rq->lock);
+    sched_enqueue(rq, t);
+    spin_unlock_irqrestore(&rq->lock, flags);
+    return t;
+}
+
+void thread_exit(void) {
+    __asm__ volatile ("cli");
+    runq_t *rq = &runqs[smp_cpu_id()];
+    ticket_lock(&rq->lock);
+    sched_running()->state = THREAD_EXITING;
+    schedule_locked(rq);
+}
+
+thread_t* sched_current(void) {
+    return sched_running();
+}
+
+void sched_yield(void) {
+    uint32_t flags = irq_save();
+    schedule();
+    irq_restore(flags);
+}
+
+/* Callers check their wake-up condition and call this until it holds. A
+ * wake-up that comes after the check but before the block is remembered
+ * in wake_pending and makes this return at once; it may also return
+ * early for an unrelated wake-up. */
+void sched_block(void) {
+    uint32_t flags = irq_save();
+    runq_t *rq = &runqs[smp_cpu_id()];
+    thread_t *self = sched_running();
+    ticket_lock(&rq->lock);
+    if (self->wake_pending) {
+        self->wake_pending = 0;
+        ticket_unlock(&rq->lock);
+    } else {
+        self->state = THREAD_BLOCKED;
+        schedule_locked(rq);
+    }
+    irq_restore(flags);
+}
+
+/* Safe from interrupt handlers. Called from a thread with interrupts on,
+ * a better woken thread on this CPU runs right away; from an interrupt,
+ * on its way out. t->cpu only changes under the lock of the queue it
+ * names, hence the check after locking. */
+void HOT_TEXT sched_wake(thread_t *t) {
+    uint32_t flags = irq_save();
+    runq_t *rq;
+    for (;;) {
+        uint32_t cpu = t->cpu;
+        rq = &runqs[cpu];
+        ticket_lock(&rq->lock);
+        if (t->cpu == cpu) break;
+        ticket_unlock(&rq->lock);
+    }
+    if (t->state == THREAD_BLOCKED) sched_enqueue(rq, t);
+    else if (t->state == THREAD_RUNNING || t->state == THREAD_READY) t->wake_pending = 1;
+    ticket_unlock(&rq->lock);
+
+    cpu_t *cpu = smp_this_cpu();
+    if (cpu->need_resched && (flags & EFLAGS_IF) && !cpu->preempt_count) schedule();
+    irq_restore(flags);
+}
+
+/* On the sleeper's stack. The sleeper waits for fired rather than for the
+ * timer to leave the wheel, so the callback is done with it by the time
+ * sched_sleep returns. */
+typedef struct {
+    timer_t timer;
+    thread_t *thread;
+    volatile int fired;
+} sched_sleeper_t;
+
+static void sched_sleep_wake(void *arg) {
+    sched_sleeper_t *s = arg;
+    thread_t *t = s->thread;
+    __atomic_store_n(&s->fired, 1, __ATOMIC_RELEASE);
+    sched_wake(t);
+}
+
+void sched_sleep(uint32_t ms) {
+    sched_sleeper_t s;
+    timer_setup(&s.timer, sched_sleep_wake, &s);
+    s.thread = sched_running();
+    s.fired = 0;
+    uint32_t flags = irq_save();
+    timer_arm(&s.timer, ms);
+    while (!__atomic_load_n(&s.fired, __ATOMIC_ACQUIRE)) sched_block();
+    irq_restore(flags);
+}
+
+/* Called by the interrupt and syscall stubs after the handler, with
+ * interrupts off. */
+void HOT_TEXT sched_irq_exit(void) {
+    cpu_t *cpu = smp_this_cpu();
+    if (cpu->need_resched && !cpu->preempt_count) schedule();
+}
+
+/* Keeps the running thread on its CPU until the matching enable. Nests;
+ * the thread must not block in between. A switch that came due meanwhile
+ * happens at the enable, or with interrupts off at the next
+ * sched_irq_exit. The count is per CPU and changed with one instruction,
+ * so it is right even if the thread moves just before the disable. */
+void HOT_TEXT sched_preempt_disable(void) {
+    __asm__ volatile ("incl %%gs:%c0" : : "i"(__builtin_offsetof(cpu_t, preempt_count)) : "memory");
+}
+
+void HOT_TEXT sched_preempt_enable(void) {
+    __asm__ volatile ("decl %%gs:%c0" : : "i"(__builtin_offsetof(cpu_t, preempt_count)) : "memory");
+    cpu_t *cpu = smp_this_cpu();
+    if (cpu->preempt_count || !cpu->need_resched) return;
+    uint32_t flags = irq_save();
+    cpu = smp_this_cpu();
+    if ((flags & EFLAGS_IF) && cpu->need_resched && !cpu->preempt_count) schedule();
+    irq_restore(flags);
+}
+
+void spin_lock(spinlock_t *l) {
+    sched_preempt_disable();
+    ticket_lock(l);
+}
+
+void spin_unlock(spinlock_t *l) {
+    ticket_unlock(l);
+    sched_preempt_enable();
+}
+
+int sched_stack_guard(uint32_t addr) {
+    for (int i = 0; i < SCHED_MAX_THREADS; i++) {
+        if (threads[i].stack && (addr & ~0xFFF) == (uintptr_t)threads[i].stack) return 1;
+    }
+    return 0;
+}
+
+/* A waiter stays queued across early returns from sched_block; it only
+ * leaves the queue when woken by mutex_unlock or when it takes the lock
+ * while still queued. */
+void mutex_lock(mutex_t *m) {
+    thread_t *self = sched_running();
+    for (;;) {
+        uint32_t flags = spin_lock_irqsave(&m->lock);
+        if (!m->owner) {
+            m->owner = self;
+            if (self->waiting) {
+                thread_t **link = &m->waiters;
+                while (*link != self) link = &(*link)->wait_next;
+                *link = self->wait_next;
+                self->waiting = 0;
+            }
+            spin_unlock_irqrestore(&m->lock, flags);
+            return;
+        }
+        if (!self->waiting) {
+            thread_t **tail = &m->waiters;
+            while (*tail) tail = &(*tail)->wait_next;
+            self->wait_next = NULL;
+            *tail = self;
+            self->waiting = 1;
+        }
+        spin_unlock_irqrestore(&m->lock, flags);
+        sched_block();
+    }
+}
+
+/* Wakes the longest waiter, which takes the lock unless someone else got
+ * there first. */
+void mutex_unlock(mutex_t *m) {
+    uint32_t flags = spin_lock_irqsave(&m->lock);
+    m->owner = NULL;
+    thread_t *t = m->waiters;
+    if (t) {
+        m->waiters = t->wait_next;
+        t->waiting = 0;
+    }
+    spin_unlock_irqrestore(&m->lock, flags);
+    if (t) sched_wake(t);
+}
+
+static char* sched_put_uint(char *p, uint32_t val, int width) {
+    char tmp[12];
+    int len = 0;
+    do { tmp[len++] = '0' + val % 10; val /= 10; } while (val);
+    while (len < width) tmp[len++] = ' ';
+    while (len) *p++ = tmp[--len];
+    *p = 0;
+    return p;
+}
+
+static char* sched_put_text(char *p, const char *text, int width) {
+    int len = 0;
+    for (; *text; len++) *p++ = *text++;
+    for (; len < width; len++) *p++ = ' ';
+    *p = 0;
+    return p;
+}
+
+/* Unlocked snapshot; a line may be stale by the time it is printed. */
+void sched_show_info(void) {
+    static const char *prios[] = {"ui", "shell", "idle"};
+    static const char *states[] = {"free", "ready", "running", "blocked", "exiting"};
+    char line[80];
+
+    shell_println("=== Threads ===", COLOR_TITLE);
+    shell_println("   ID  Name    Prio   State    CPU TTY  Switches   CPU ms", COLOR_INFO);
+    thread_t *self = sched_running();
+    for (int i = 0; i < SCHED_MAX_THREADS; i++) {
+        thread_t *t = &threads[i];
+        if (t->state == THREAD_FREE) continue;
+        uint64_t cycles = t->cycles;
+        if (t->state == THREAD_RUNNING) cycles += rdtsc() - runqs[t->cpu].switched_at;
+        uint32_t ms = clock_div(clock_cycles_to_ns(cycles), 1000000, NULL);
+
+        char *p = sched_put_uint(line, t->id, 5);
+        p = sched_put_text(p, "  ", 2);
+        p = sched_put_text(p, t->name, 8);
+        p = sched_put_text(p, prios[t->prio], 7);
+        p = sched_put_text(p, states[t->state], 9);
+        p = sched_put_uint(p, t->cpu, 3);
+        p = sched_put_uint(p, t->screen + 1, 4);
+        p = sched_put_uint(p, t->switches, 10);
+        sched_put_uint(p, ms, 9);
+        shell_println(line, t == self ? COLOR_ACCENT : COLOR_FG);
+    }
+
+    shell_println("  CPU  Ready  Switches  Steals", COLOR_INFO);
+    for (uint32_t i = 0; i < smp_cpu_count(); i++) {
+        char *p = sched_put_uint(line, i, 5);
+        p = sched_put_uint(p, runqs[i].ready, 7);
+        p = sched_put_uint(p, runqs[i].switches, 10);
+        sched_put_uint(p, runqs[i].steals, 8);
+        shell_println(line, COLOR_FG);
+    }
+}
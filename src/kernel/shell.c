@@ -4,20 +4,54 @@
 #include "editor.h"
 #include "network.h"
 #include "compiler.h"
+#include "pmm.h"
+#include "paging.h"
+#include "sched.h"
 
 extern void fb_clear_region(uint32_t x, uint32_t y, uint32_t w, uint32_t h);
 extern void fb_draw_text(uint32_t x, uint32_t y, const char *text, uint32_t color);
 extern void fb_fill_rect(uint32_t x, uint32_t y, uint32_t w, uint32_t h, uint32_t color);
 extern void fb_putchar(uint32_t x, uint32_t y, char c, uint8_t color);
+extern void fb_set_cell(uint32_t x, uint32_t y, uint16_t cell);
+extern void fb_read_row(uint32_t y, uint16_t *dst);
+extern void fb_write_row(uint32_t y, const uint16_t *src);
+extern void fb_scroll_region(uint32_t top, uint32_t bottom);
+extern void fb_poll(void);
+extern int fb_selected(void);
+extern void* mem_alloc(size_t size);
+extern void mem_free(void *ptr);
+extern void mem_show_stats(void);
+extern void mem_show_profile(void);
+extern void mem_set_scrub_policy(int policy);
+extern void cache_show_info(void);
+extern void cache_bench(void);
+extern void syscall_bench(void);
+extern void cache_show_warm(void);
+extern void clock_show_uptime(void);
+extern void timer_show_info(void);
 
 static char history[10][256];
 static int history_count = 0;
-static int shell_cursor = 1;
-static int shell_col = 0;
+
+/* Output position per screen, so each VT thread prints where its own
+ * output left off. Printing holds console_lock, since scrolling touches
+ * the shared scrollback and VT threads print from every CPU. */
+typedef struct {
+    int cursor;
+    int col;
+} shell_out_t;
+
+static shell_out_t shell_outs[FB_SCREENS] = {[0 ... FB_SCREENS - 1] = {1, 0}};
+static spinlock_t console_lock = SPINLOCK_INIT;
+
+/* compiler.c and teascript.c keep their state in globals, so the
+ * commands that use them take turns. */
+static mutex_t tools_lock = MUTEX_INIT;
+
 extern int current_theme;
 
 #define SCROLLBACK_LINES 100
-static uint16_t scrollback[SCROLLBACK_LINES][80];
+static uint16_t (*scrollback)[80] = NULL;
 static int scrollback_count = 0;
 static int scrollback_head = 0;
 static int in_scrollback = 0;
@@ -113,58 +147,49 @@ static uint32_t shell_parse_ip(const char *s) {
 }
 
 static void shell_scroll_up(void) {
-    volatile uint16_t *vga = (volatile uint16_t*)0xB8000;
-    for (int x = 0; x < 80; x++) {
-        scrollback[scrollback_head][x] = vga[1 * 80 + x];
-    }
-    scrollback_head = (scrollback_head + 1) % SCROLLBACK_LINES;
-    if (scrollback_count < SCROLLBACK_LINES) scrollback_count++;
-    for (int y = 1; y < 22; y++) {
-        for (int x = 0; x < 80; x++) {
-            vga[y * 80 + x] = vga[(y + 1) * 80 + x];
-        }
-    }
-    for (int x = 0; x < 80; x++) {
-        vga[22 * 80 + x] = (COLOR_FG << 8) | ' ';
+    if (scrollback) {
+        fb_read_row(1, scrollback[scrollback_head]);
+        scrollback_head = (scrollback_head + 1) % SCROLLBACK_LINES;
+        if (scrollback_count < SCROLLBACK_LINES) scrollback_count++;
     }
+    fb_scroll_region(1, 22);
 }
 
 static void scrollback_redraw(void) {
-    volatile uint16_t *vga = (volatile uint16_t*)0xB8000;
+    uint16_t blank[80];
+    for (int x = 0; x < 80; x++)
+        blank[x] = (COLOR_FG << 8) | ' ';
     for (int row = 0; row < 22; row++) {
         int ci = scrollback_count - view_offset + row;
         if (ci >= scrollback_count) {
-            int sr = ci - scrollback_count;
-            for (int x = 0; x < 80; x++)
-                vga[(row + 1) * 80 + x] = saved_screen[sr][x];
+            fb_write_row(row + 1, saved_screen[ci - scrollback_count]);
         } else if (ci >= 0) {
             int bi = (scrollback_head - scrollback_count + ci + SCROLLBACK_LINES) % SCROLLBACK_LINES;
-            for (int x = 0; x < 80; x++)
-                vga[(row + 1) * 80 + x] = scrollback[bi][x];
+            fb_write_row(row + 1, scrollback[bi]);
         } else {
-            for (int x = 0; x < 80; x++)
-                vga[(row + 1) * 80 + x] = (COLOR_FG << 8) | ' ';
+            fb_write_row(row + 1, blank);
         }
     }
 }
 
 static void scrollback_show_indicator(void) {
-    volatile uint16_t *vga = (volatile uint16_t*)0xB8000;
     for (int x = 0; x < 80; x++)
-        vga[23 * 80 + x] = (0x70 << 8) | ' ';
+        fb_set_cell(x, 23, (0x70 << 8) | ' ');
     const char *msg = "[SCROLLBACK] Alt+PgUp/PgDn | Any key to exit";
     int start = 17;
     for (int i = 0; msg[i]; i++)
-        vga[23 * 80 + start + i] = (0x70 << 8) | msg[i];
+        fb_set_cell(start + i, 23, (0x70 << 8) | msg[i]);
 }
 
 void shell_scroll_view_up(void) {
-    if (scrollback_count == 0) return;
-    volatile uint16_t *vga = (volatile uint16_t*)0xB8000;
+    spin_lock(&console_lock);
+    if (scrollback_count == 0) {
+        spin_unlock(&console_lock);
+        return;
+    }
     if (!in_scrollback) {
         for (int y = 0; y < 22; y++)
-            for (int x = 0; x < 80; x++)
-                saved_screen[y][x] = vga[(y + 1) * 80 + x];
+            fb_read_row(y + 1, saved_screen[y]);
         in_scrollback = 1;
         view_offset = 0;
     }
@@ -172,27 +197,32 @@ void shell_scroll_view_up(void) {
     if (view_offset > scrollback_count) view_offset = scrollback_count;
     scrollback_redraw();
     scrollback_show_indicator();
+    spin_unlock(&console_lock);
 }
 
 void shell_scroll_view_down(void) {
-    if (!in_scrollback) return;
+    spin_lock(&console_lock);
+    if (!in_scrollback) {
+        spin_unlock(&console_lock);
+        return;
+    }
     view_offset -= 5;
     if (view_offset <= 0) {
         view_offset = 0;
         in_scrollback = 0;
-        volatile uint16_t *vga = (volatile uint16_t*)0xB8000;
         for (int y = 0; y < 22; y++)
-            for (int x = 0; x < 80; x++)
-                vga[(y + 1) * 80 + x] = saved_screen[y][x];
+            fb_write_row(y + 1, saved_screen[y]);
         extern void draw_status_bar(void);
         draw_status_bar();
         fb_clear_region(0, 23, 80, 1);
         extern void draw_prompt(void);
         draw_prompt();
+        spin_unlock(&console_lock);
         return;
     }
     scrollback_redraw();
     scrollback_show_indicator();
+    spin_unlock(&console_lock);
 }
 
 int shell_in_scrollback(void) {
@@ -200,33 +230,40 @@ int shell_in_scrollback(void) {
 }
 
 void shell_exit_scrollback(void) {
-    if (!in_scrollback) return;
+    spin_lock(&console_lock);
+    if (!in_scrollback) {
+        spin_unlock(&console_lock);
+        return;
+    }
     in_scrollback = 0;
     view_offset = 0;
-    volatile uint16_t *vga = (volatile uint16_t*)0xB8000;
     for (int y = 0; y < 22; y++)
-        for (int x = 0; x < 80; x++)
-            vga[(y + 1) * 80 + x] = saved_screen[y][x];
+        fb_write_row(y + 1, saved_screen[y]);
     extern void draw_status_bar(void);
     draw_status_bar();
     fb_clear_region(0, 23, 80, 1);
     extern void draw_prompt(void);
     draw_prompt();
+    spin_unlock(&console_lock);
 }
 
-void shell_println(const char *text, uint8_t color) {
-    if (shell_col > 0) {
-        shell_col = 0;
-        shell_cursor++;
+void HOT_TEXT shell_println(const char *text, uint8_t color) {
+    spin_lock(&console_lock);
+    shell_out_t *out = &shell_outs[fb_selected()];
+    if (out->col > 0) {
+        out->col = 0;
+        out->cursor++;
     }
-    if (shell_cursor >= 23) {
+    if (out->cursor >= 23) {
         shell_scroll_up();
-        shell_cursor = 22;
+        out->cursor = 22;
     }
-    fb_clear_region(0, shell_cursor, 80, 1);
-    fb_draw_text(0, shell_cursor, text, color);
-    shell_cursor++;
-    shell_col = 0;
+    fb_clear_region(0, out->cursor, 80, 1);
+    fb_draw_text(0, out->cursor, text, color);
+    out->cursor++;
+    out->col = 0;
+    fb_poll();
+    spin_unlock(&console_lock);
 }
 
 void shell_newline(void) {
@@ -234,42 +271,49 @@ void shell_newline(void) {
 }
 
 void shell_reset_cursor(void) {
-    shell_cursor = 1;
-    shell_col = 0;
+    shell_out_t *out = &shell_outs[fb_selected()];
+    out->cursor = 1;
+    out->col = 0;
 }
 
-void shell_putchar(char c, uint8_t color) {
-    volatile uint16_t *vga = (volatile uint16_t*)0xB8000;
-
+void HOT_TEXT shell_putchar(char c, uint8_t color) {
+    spin_lock(&console_lock);
+    shell_out_t *out = &shell_outs[fb_selected()];
     if (c == '\n') {
-        shell_col = 0;
-        shell_cursor++;
-        if (shell_cursor >= 23) {
+        out->col = 0;
+        out->cursor++;
+        if (out->cursor >= 23) {
             shell_scroll_up();
-            shell_cursor = 22;
+            out->cursor = 22;
         }
+        fb_poll();
+        spin_unlock(&console_lock);
         return;
     }
 
-    if (shell_col < 80) {
-        vga[shell_cursor * 80 + shell_col] = ((uint16_t)color << 8) | (uint8_t)c;
-        shell_col++;
+    if (out->col < 80) {
+        fb_set_cell(out->col, out->cursor, ((uint16_t)color << 8) | (uint8_t)c);
+        out->col++;
     }
-    if (shell_col >= 80) {
-        shell_col = 0;
-        shell_cursor++;
-        if (shell_cursor >= 23) {
+    if (out->col >= 80) {
+        out->col = 0;
+        out->cursor++;
+        if (out->cursor >= 23) {
             shell_scroll_up();
-            shell_cursor = 22;
+            out->cursor = 22;
         }
     }
+    spin_unlock(&console_lock);
 }
 
 void shell_clear_output(void) {
+    spin_lock(&console_lock);
+    shell_out_t *out = &shell_outs[fb_selected()];
     for (int y = 1; y < 23; y++)
         fb_clear_region(0, y, 80, 1);
-    shell_cursor = 1;
-    shell_col = 0;
+    out->cursor = 1;
+    out->col = 0;
+    spin_unlock(&console_lock);
 }
 
 void shell_print(int line, const char *text, uint8_t color) {
@@ -279,7 +323,11 @@ void shell_print(int line, const char *text, uint8_t color) {
 
 void shell_init(void) {
     history_count = 0;
-    shell_cursor = 1;
+    for (int i = 0; i < FB_SCREENS; i++) {
+        shell_outs[i].cursor = 1;
+        shell_outs[i].col = 0;
+    }
+    if (!scrollback) scrollback = pmm_alloc(pmm_order_for(SCROLLBACK_LINES * 80 * sizeof(uint16_t)));
     scrollback_count = 0;
     scrollback_head = 0;
     in_scrollback = 0;
@@ -296,6 +344,7 @@ void shell_execute(const char *input_buffer) {
         shell_println("  theme <n>   Set theme       | cpuid       CPU info", COLOR_FG);
         shell_println("  lspci       PCI devices     | history     Cmd history", COLOR_FG);
         shell_println("  halt        Shutdown        | reboot      Restart", COLOR_FG);
+        shell_println("  uptime      Time since boot | ps          Threads", COLOR_FG);
         shell_println(" Files:", t.accent);
         shell_println("  ls [-l]     List files      | cat <f>     Show file", COLOR_FG);
         shell_println("  touch <f>   Create file     | rm [-rf]    Remove", COLOR_FG);
@@ -312,7 +361,9 @@ void shell_execute(const char *input_buffer) {
         shell_println(" Debug:", t.accent);
         shell_println("  peek <a>    Read mem        | poke <a><v> Write mem", COLOR_FG);
         shell_println("  dump <a><n> Hex dump        | xxd <f>     File hex dump", COLOR_FG);
-        shell_println("  inb/outb    I/O ports", COLOR_FG);
+        shell_println("  inb/outb    I/O ports       | meminfo     Heap stats", COLOR_FG);
+        shell_println("  cacheinfo   MTRR/PAT layout | cachebench  Flush bench", COLOR_FG);
+        shell_println("  sysbench    Syscall paths   |", COLOR_FG);
 
     } else if (shell_strcmp(input_buffer, "whoami") == 0) {
         shell_println("", COLOR_FG);
@@ -433,7 +484,9 @@ void shell_execute(const char *input_buffer) {
         }
 
     } else if (shell_strcmp(input_buffer, "pwd") == 0) {
-        shell_println(fs_pwd(), COLOR_FG);
+        char pwd[128];
+        fs_pwd(pwd);
+        shell_println(pwd, COLOR_FG);
 
     } else if (shell_startswith(input_buffer, "cat")) {
         const char *arg = shell_get_arg(input_buffer, 1);
@@ -442,13 +495,14 @@ void shell_execute(const char *input_buffer) {
             shell_println("  -h         Show this help", COLOR_FG);
             shell_println("  <filename> Display file contents", COLOR_FG);
         } else {
-            file_t *file = fs_open(arg);
-            if (file) {
-                for (uint32_t i = 0; i < file->size; i++) {
+            uint8_t *data = mem_alloc(MAX_FILESIZE);
+            int size = data ? fs_read_file(arg, data, MAX_FILESIZE) : -1;
+            if (size >= 0) {
+                for (int i = 0; i < size; i++) {
                     char linebuf[81];
                     int col = 0;
-                    while (i < file->size && file->data[i] != '\n' && col < 79) {
-                        linebuf[col++] = file->data[i++];
+                    while (i < size && data[i] != '\n' && col < 79) {
+                        linebuf[col++] = data[i++];
                     }
                     linebuf[col] = 0;
                     shell_println(linebuf, COLOR_FG);
@@ -456,6 +510,7 @@ void shell_execute(const char *input_buffer) {
             } else {
                 shell_println("Error: file not found", COLOR_ERROR);
             }
+            if (data) mem_free(data);
         }
 
     } else if (shell_startswith(input_buffer, "rm")) {
@@ -522,7 +577,9 @@ void shell_execute(const char *input_buffer) {
     } else if (shell_strcmp(input_buffer, "teas -doc -5") == 0) {
         tvm_show_doc(5);
     } else if (shell_startswith(input_buffer, "teas ")) {
+        mutex_lock(&tools_lock);
         tvm_execute(input_buffer + 5);
+        mutex_unlock(&tools_lock);
 
     } else if (shell_startswith(input_buffer, "peek")) {
         const char *arg = shell_get_arg(input_buffer, 1);
@@ -818,7 +875,9 @@ void shell_execute(const char *input_buffer) {
                 outname[i] = '.'; outname[i+1] = 't'; outname[i+2] = 'b';
                 outname[i+3] = 'i'; outname[i+4] = 'n'; outname[i+5] = 0;
             }
+            mutex_lock(&tools_lock);
             tcc_compile(arg, outname);
+            mutex_unlock(&tools_lock);
         }
 
     } else if (shell_startswith(input_buffer, "asm")) {
@@ -835,6 +894,7 @@ void shell_execute(const char *input_buffer) {
             shell_println("  Flow: jmp je jne jl jle jg jge call ret", t.accent);
             shell_println("  Data: db val,val,...  nop hlt int", t.accent);
         } else {
+            mutex_lock(&tools_lock);
             int aoff = 1;
             if (shell_strcmp(arg, "-d") == 0) {
                 asm_debug = 1;
@@ -857,6 +917,7 @@ void shell_execute(const char *input_buffer) {
                 asm_assemble(arg, outname);
             }
             asm_debug = 0;
+            mutex_unlock(&tools_lock);
         }
 
     } else if (shell_startswith(input_buffer, "run")) {
@@ -868,6 +929,7 @@ void shell_execute(const char *input_buffer) {
             shell_println("  .tbin      Run TeaScript bytecode (via TVM)", COLOR_FG);
             shell_println("  .bin       Run native x86 code (must end with ret)", COLOR_FG);
         } else {
+            mutex_lock(&tools_lock);
             if (shell_strcmp(arg, "-d") == 0) {
                 asm_debug = 1;
                 arg = shell_get_arg(input_buffer, 2);
@@ -878,6 +940,7 @@ void shell_execute(const char *input_buffer) {
                 exec_run(arg);
             }
             asm_debug = 0;
+            mutex_unlock(&tools_lock);
         }
 
     } else if (shell_startswith(input_buffer, "xxd")) {
@@ -887,12 +950,11 @@ void shell_execute(const char *input_buffer) {
             shell_println("  -h      Show this help", COLOR_FG);
             shell_println("  Hex dump file contents (first 64 bytes)", COLOR_FG);
         } else {
-            file_t *f = fs_open(arg);
-            if (!f) {
+            uint8_t *fdata = mem_alloc(MAX_FILESIZE);
+            int fsize = fdata ? fs_read_file(arg, fdata, MAX_FILESIZE) : -1;
+            if (fsize < 0) {
                 shell_println("File not found", COLOR_ERROR);
             } else {
-                uint8_t fdata[MAX_FILESIZE];
-                int fsize = fs_read(f, fdata, MAX_FILESIZE);
                 char msg[80];
                 shell_strcopy(msg, "Size: ");
                 int ml = 6;
@@ -924,6 +986,99 @@ void shell_execute(const char *input_buffer) {
                     shell_println(line, COLOR_ACCENT);
                 }
             }
+            if (fdata) mem_free(fdata);
+        }
+
+    } else if (shell_startswith(input_buffer, "meminfo")) {
+        const char *arg = shell_get_arg(input_buffer, 1);
+        if (!arg) {
+            mem_show_stats();
+        } else if (shell_strcmp(arg, "-h") == 0) {
+            shell_println("Usage: meminfo [options]", COLOR_FG);
+            shell_println("  -h              Show this help", COLOR_FG);
+            shell_println("  (no args)       Heap usage and allocator counters", COLOR_FG);
+            shell_println("  -p              Sampled allocations per call site", COLOR_FG);
+            shell_println("  -m              Physical pages, paging and E820 map", COLOR_FG);
+            shell_println("  -s <policy>     Scrub policy: none, alloc, free", COLOR_FG);
+        } else if (shell_strcmp(arg, "-p") == 0) {
+            mem_show_profile();
+        } else if (shell_strcmp(arg, "-m") == 0) {
+            pmm_show_info();
+            paging_show_info();
+            pmm_show_map();
+        } else if (shell_strcmp(arg, "-s") == 0) {
+            const char *policy = shell_get_arg(input_buffer, 2);
+            if (policy && shell_strcmp(policy, "none") == 0) {
+                mem_set_scrub_policy(MEM_SCRUB_NONE);
+                shell_println("Scrub policy: none", COLOR_SUCCESS);
+            } else if (policy && shell_strcmp(policy, "alloc") == 0) {
+                mem_set_scrub_policy(MEM_SCRUB_ALLOC);
+                shell_println("Scrub policy: zero on alloc", COLOR_SUCCESS);
+            } else if (policy && shell_strcmp(policy, "free") == 0) {
+                mem_set_scrub_policy(MEM_SCRUB_FREE);
+                shell_println("Scrub policy: scrub on free", COLOR_SUCCESS);
+            } else {
+                shell_println("Usage: meminfo -s <none|alloc|free>", COLOR_ERROR);
+            }
+        } else {
+            shell_println("Unknown option. Use: meminfo -h", COLOR_ERROR);
+        }
+
+    } else if (shell_startswith(input_buffer, "cacheinfo")) {
+        const char *arg = shell_get_arg(input_buffer, 1);
+        if (arg && shell_strcmp(arg, "-h") == 0) {
+            shell_println("Usage: cacheinfo [-w]", COLOR_FG);
+            shell_println("  -h      Show this help", COLOR_FG);
+            shell_println("  -w      Hot working set residency (boot and now)", COLOR_FG);
+            shell_println("  Shows MTRR ranges, the PAT and the VGA memory type", COLOR_FG);
+        } else if (arg && shell_strcmp(arg, "-w") == 0) {
+            cache_show_warm();
+        } else {
+            cache_show_info();
+        }
+
+    } else if (shell_startswith(input_buffer, "cachebench")) {
+        const char *arg = shell_get_arg(input_buffer, 1);
+        if (arg && shell_strcmp(arg, "-h") == 0) {
+            shell_println("Usage: cachebench", COLOR_FG);
+            shell_println("  -h      Show this help", COLOR_FG);
+            shell_println("  Times wbinvd against a clflush loop on 4/64/256 KB", COLOR_FG);
+        } else {
+            cache_bench();
+        }
+
+    } else if (shell_startswith(input_buffer, "sysbench")) {
+        const char *arg = shell_get_arg(input_buffer, 1);
+        if (arg && shell_strcmp(arg, "-h") == 0) {
+            shell_println("Usage: sysbench", COLOR_FG);
+            shell_println("  -h      Show this help", COLOR_FG);
+            shell_println("  Times null syscalls through int 0x80 and SYSENTER", COLOR_FG);
+        } else {
+            syscall_bench();
+        }
+
+    } else if (shell_startswith(input_buffer, "uptime")) {
+        const char *arg = shell_get_arg(input_buffer, 1);
+        if (arg && shell_strcmp(arg, "-h") == 0) {
+            shell_println("Usage: uptime", COLOR_FG);
+            shell_println("  -h      Show this help", COLOR_FG);
+            shell_println("  Time since boot in microseconds, from the TSC,", COLOR_FG);
+            shell_println("  and the timer backend with its interrupt count", COLOR_FG);
+        } else {
+            clock_show_uptime();
+            timer_show_info();
+        }
+
+    } else if (shell_strcmp(input_buffer, "ps") == 0 || shell_startswith(input_buffer, "ps ")) {
+        const char *arg = shell_get_arg(input_buffer, 1);
+        if (arg && shell_strcmp(arg, "-h") == 0) {
+            shell_println("Usage: ps", COLOR_FG);
+            shell_println("  -h      Show this help", COLOR_FG);
+            shell_println("  Kernel threads with their priority, state, CPU,", COLOR_FG);
+            shell_println("  VT, times scheduled and CPU time, then each", COLOR_FG);
+            shell_println("  CPU's ready threads, switches and steals", COLOR_FG);
+        } else {
+            sched_show_info();
         }
 
     } else if (shell_startswith(input_buffer, "echo")) {
@@ -0,0 +1,426 @@
+#include "types.h"
+#include "smp.h"
+#include "sched.h"
+#include "paging.h"
+#include "pmm.h"
+
+extern uint64_t clock_ns(void);
+extern uint32_t clock_tsc_khz(void);
+extern void mem_copy(void *dst, const void *src, size_t n);
+extern void idt_load(void);
+extern void sysenter_init(void);
+extern void cache_save_boot(void);
+extern void cache_init_ap(void);
+
+/* Symmetric multiprocessing. The CPUs are listed by the ACPI MADT; each
+ * enabled local APIC besides the boot CPU's is started with INIT-SIPI-SIPI
+ * in a real-mode trampoline copied to SMP_TRAMPOLINE. It switches to
+ * protected mode on a flat GDT, loads the boot CPU's CR4, CR3 and CR0 and
+ * jumps to smp_ap_main on the stack of the AP's idle thread. APs are
+ * started one at a time, since they share the trampoline's parameters.
+ * An AP that misses its start-up window may still get through the
+ * trampoline later, so its slot is given up for good: the AP parks if it
+ * shows up, and no further APs are started, as a late one would pick up
+ * the next AP's parameters and stack.
+ *
+ * Every CPU loads its own GDT, whose entry 0x18 is a data segment based
+ * at its cpu_t and goes into GS, and the shared IDT. Device interrupts
+ * and the timer wheel stay on the boot CPU; an AP only takes IPIs and
+ * sits in its idle thread until it has work.
+ *
+ * Page tables are shared. When paging.c takes access away (stack guard
+ * pages, the exec buffer going read-only, XFCE pages handed back to the
+ * demand-zero pool) it calls smp_flush_tlb, which invalidates the range on
+ * every online CPU before returning. Entries that only gained access are
+ * left to go stale, and paging.c retries the faults they cause. */
+#define SMP_TRAMPOLINE 0x8000
+#define SMP_AP_TIMEOUT_MS 100
+
+#define MSR_APIC_BASE 0x1B
+#define SPURIOUS_VECTOR 0xFF
+
+#define LAPIC_ID 0x020
+#define LAPIC_EOI 0x0B0
+#define LAPIC_SPURIOUS 0x0F0
+#define LAPIC_ICR_LO 0x300
+#define LAPIC_ICR_HI 0x310
+
+#define ICR_INIT 0x4500
+#define ICR_STARTUP 0x4600
+#define ICR_PENDING 0x1000
+
+#define MADT_LAPIC 0
+#define MADT_LAPIC_ENABLED 0x1
+
+typedef struct {
+    char signature[8];
+    uint8_t checksum;
+    char oem[6];
+    uint8_t revision;
+    uint32_t rsdt;
+} __attribute__((packed)) acpi_rsdp_t;
+
+typedef struct {
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem[6];
+    char oem_table[8];
+    uint32_t oem_revision;
+    uint32_t creator;
+    uint32_t creator_revision;
+} __attribute__((packed)) acpi_header_t;
+
+typedef struct {
+    uint32_t cr0;
+    uint32_t cr3;
+    uint32_t cr4;
+    uint32_t stack;
+    uint32_t entry;
+    uint32_t cpu;
+} __attribute__((packed)) tramp_params_t;
+
+static cpu_t cpus[SMP_MAX_CPUS];
+static uint32_t cpu_count = 1;
+static volatile uint32_t *lapic = NULL;
+
+#define AP_WAITING 0
+#define AP_STARTED 1
+#define AP_ABANDONED 2
+static volatile int ap_state[SMP_MAX_CPUS];
+
+/* One shootdown at a time; tlb_pending counts the CPUs yet to flush. */
+static spinlock_t tlb_lock;
+static volatile uintptr_t tlb_start, tlb_end;
+static volatile uint32_t tlb_pending;
+
+/* Entered with CS = SMP_TRAMPOLINE >> 4 and IP = 0, so code and data are
+ * addressed as offsets from smp_trampoline, plus 0x8000 (SMP_TRAMPOLINE)
+ * once segments are flat. */
+__asm__(
+    ".pushsection .text\n"
+    ".balign 16\n"
+    ".globl smp_trampoline\n"
+    "smp_trampoline:\n"
+    ".code16\n"
+    "   cli\n"
+    "   cld\n"
+    "   mov %cs, %ax\n"
+    "   mov %ax, %ds\n"
+    "   lgdtl tramp_gdtr - smp_trampoline\n"
+    "   mov %cr0, %eax\n"
+    "   or $1, %eax\n"
+    "   mov %eax, %cr0\n"
+    "   ljmpl $0x08, $(tramp_pm - smp_trampoline + 0x8000)\n"
+    ".code32\n"
+    "tramp_pm:\n"
+    "   mov $0x10, %ax\n"
+    "   mov %ax, %ds\n"
+    "   mov %ax, %es\n"
+    "   mov %ax, %fs\n"
+    "   mov %ax, %gs\n"
+    "   mov %ax, %ss\n"
+    "   mov tramp_params - smp_trampoline + 0x8000 + 8, %eax\n"
+    "   mov %eax, %cr4\n"
+    "   mov tramp_params - smp_trampoline + 0x8000 + 4, %eax\n"
+    "   mov %eax, %cr3\n"
+    "   mov tramp_params - smp_trampoline + 0x8000, %eax\n"
+    "   mov %eax, %cr0\n"
+    "   mov tramp_params - smp_trampoline + 0x8000 + 12, %esp\n"
+    "   pushl tramp_params - smp_trampoline + 0x8000 + 20\n"
+    "   pushl $0\n"
+    "   jmp *tramp_params - smp_trampoline + 0x8000 + 16\n"
+    "tramp_gdt:\n"
+    "   .quad 0\n"
+    "   .quad 0x00CF9A000000FFFF\n"
+    "   .quad 0x00CF92000000FFFF\n"
+    "tramp_gdtr:\n"
+    "   .word tramp_gdtr - tramp_gdt - 1\n"
+    "   .long tramp_gdt - smp_trampoline + 0x8000\n"
+    ".globl tramp_params\n"
+    "tramp_params:\n"
+    "   .fill 6, 4, 0\n"
+    ".globl smp_trampoline_end\n"
+    "smp_trampoline_end:\n"
+    ".popsection\n"
+);
+extern uint8_t smp_trampoline[], tramp_params[], smp_trampoline_end[];
+
+static inline void wrmsr(uint32_t msr, uint32_t low, uint32_t high) {
+    __asm__ volatile ("wrmsr" : : "c"(msr), "a"(low), "d"(high));
+}
+
+static inline void rdmsr(uint32_t msr, uint32_t *low, uint32_t *high) {
+    __asm__ volatile ("rdmsr" : "=a"(*low), "=d"(*high) : "c"(msr));
+}
+
+static inline uint32_t irq_save(void) {
+    uint32_t flags;
+    __asm__ volatile ("pushf\npop %0\ncli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+static inline void irq_restore(uint32_t flags) {
+    __asm__ volatile ("push %0\npopf" : : "r"(flags) : "memory", "cc");
+}
+
+/* Flat code and data as in boot.asm, then the per-CPU segment. */
+static void smp_load_gdt(cpu_t *cpu) {
+    uint32_t base = (uint32_t)cpu, limit = sizeof(cpu_t) - 1;
+    cpu->gdt[0] = 0;
+    cpu->gdt[1] = 0x00CF9A000000FFFFULL;
+    cpu->gdt[2] = 0x00CF92000000FFFFULL;
+    cpu->gdt[3] = (limit & 0xFFFF) | ((uint64_t)(base & 0xFFFFFF) << 16) |
+                  (0x92ULL << 40) | ((uint64_t)(limit >> 16) << 48) |
+                  (0x4ULL << 52) | ((uint64_t)(base >> 24) << 56);
+
+    struct {
+        uint16_t limit;
+        uint32_t base;
+    } __attribute__((packed)) gdtr = {sizeof(cpu->gdt) - 1, (uint32_t)cpu->gdt};
+    __asm__ volatile (
+        "lgdt %0\n"
+        "ljmp $0x08, $1f\n"
+        "1:\n"
+        "mov $0x10, %%ax\n"
+        "mov %%ax, %%ds\n"
+        "mov %%ax, %%es\n"
+        "mov %%ax, %%fs\n"
+        "mov %%ax, %%ss\n"
+        "mov $0x18, %%ax\n"
+        "mov %%ax, %%gs\n"
+        : : "m"(gdtr) : "eax", "memory");
+}
+
+/* First thing in kmain, so per-CPU data works from the start. */
+void smp_early_init(void) {
+    cpus[0].self = &cpus[0];
+    cpus[0].id = 0;
+    cpus[0].online = 1;
+    smp_load_gdt(&cpus[0]);
+}
+
+uint32_t smp_cpu_count(void) {
+    return cpu_count;
+}
+
+cpu_t* smp_cpu(uint32_t id) {
+    return &cpus[id];
+}
+
+static void smp_delay_us(uint32_t us) {
+    uint64_t start = clock_ns();
+    while (clock_ns() - start < (uint64_t)us * 1000) __asm__ volatile ("pause");
+}
+
+/* Interrupts are off so that an IPI sent from a handler cannot land
+ * between the two ICR writes. */
+static void smp_icr(uint32_t apic_id, uint32_t low) {
+    uint32_t flags = irq_save();
+    lapic[LAPIC_ICR_HI / 4] = apic_id << 24;
+    lapic[LAPIC_ICR_LO / 4] = low;
+    while (lapic[LAPIC_ICR_LO / 4] & ICR_PENDING) __asm__ volatile ("pause");
+    irq_restore(flags);
+}
+
+void smp_send_ipi(uint32_t cpu, uint32_t vector) {
+    smp_icr(cpus[cpu].apic_id, vector);
+}
+
+/* The sender has already set need_resched; the switch happens in
+ * sched_irq_exit on the way out. */
+void smp_resched_irq(void) {
+    smp_this_cpu()->ipis++;
+    lapic[LAPIC_EOI / 4] = 0;
+}
+
+static void smp_invlpg_range(uintptr_t start, uintptr_t end) {
+    for (uintptr_t page = start; page < end; page += 0x1000)
+        __asm__ volatile ("invlpg (%0)" :: "r"(page) : "memory");
+}
+
+void smp_tlb_irq(void) {
+    smp_this_cpu()->ipis++;
+    smp_invlpg_range(tlb_start, tlb_end);
+    __atomic_sub_fetch(&tlb_pending, 1, __ATOMIC_RELEASE);
+    lapic[LAPIC_EOI / 4] = 0;
+}
+
+/* Waits for every other online CPU to flush the range, so it must be
+ * called with interrupts on and without any lock those CPUs may be
+ * spinning on with interrupts off. A CPU that comes online meanwhile
+ * starts with an empty TLB. */
+void smp_flush_tlb(uintptr_t start, uintptr_t end) {
+    if (cpu_count == 1 || !lapic) return;
+    spin_lock(&tlb_lock);
+    uint32_t self = smp_cpu_id(), n = 0;
+    smp_invlpg_range(start, end);
+    tlb_start = start;
+    tlb_end = end;
+    for (uint32_t i = 0; i < cpu_count; i++)
+        if (i != self && cpus[i].online) n++;
+    __atomic_store_n(&tlb_pending, n, __ATOMIC_RELEASE);
+    for (uint32_t i = 0; i < cpu_count && n; i++)
+        if (i != self && cpus[i].online) smp_send_ipi(i, SMP_TLB_VECTOR);
+    while (__atomic_load_n(&tlb_pending, __ATOMIC_ACQUIRE)) __asm__ volatile ("pause");
+    spin_unlock(&tlb_lock);
+}
+
+/* For a kernel panic: the other CPUs stop where they are, locks and all. */
+void smp_halt_others(void) {
+    if (cpu_count == 1 || !lapic) return;
+    uint32_t self = smp_cpu_id();
+    for (uint32_t i = 0; i < cpu_count; i++)
+        if (i != self && cpus[i].online) smp_send_ipi(i, SMP_HALT_VECTOR);
+}
+
+static int acpi_checksum(const void *table, uint32_t len) {
+    const uint8_t *p = table;
+    uint8_t sum = 0;
+    for (uint32_t i = 0; i < len; i++) sum += p[i];
+    return sum == 0;
+}
+
+static int acpi_signature(const char *sig, const char *expect, int len) {
+    for (int i = 0; i < len; i++) {
+        if (sig[i] != expect[i]) return 0;
+    }
+    return 1;
+}
+
+static const acpi_rsdp_t* acpi_scan_rsdp(uintptr_t start, uintptr_t end) {
+    for (uintptr_t p = start; p + sizeof(acpi_rsdp_t) <= end; p += 16) {
+        const acpi_rsdp_t *rsdp = (const acpi_rsdp_t*)p;
+        if (acpi_signature(rsdp->signature, "RSD PTR ", 8) && acpi_checksum(rsdp, 20)) return rsdp;
+    }
+    return NULL;
+}
+
+/* The RSDP is in the first KB of the EBDA, whose segment is in the BIOS
+ * data area on the NULL page, or in the BIOS area below 1 MB. */
+static const acpi_rsdp_t* acpi_find_rsdp(void) {
+    paging_set_flags(0, 0x1000, PG_PRESENT, 0);
+    uintptr_t ebda = (uintptr_t)*(volatile uint16_t*)phys_ptr(0x40E) << 4;
+    paging_set_flags(0, 0x1000, 0, PG_PRESENT);
+
+    const acpi_rsdp_t *rsdp = NULL;
+    if (ebda >= 0x80000 && ebda < 0xA0000) rsdp = acpi_scan_rsdp(ebda, ebda + 1024);
+    if (!rsdp) rsdp = acpi_scan_rsdp(0xE0000, 0x100000);
+    return rsdp;
+}
+
+/* APIC IDs of the enabled CPUs in the MADT; 0 without ACPI. */
+static uint32_t acpi_madt_cpus(uint8_t *ids, uint32_t max) {
+    const acpi_rsdp_t *rsdp = acpi_find_rsdp();
+    if (!rsdp) return 0;
+    const acpi_header_t *rsdt = (const acpi_header_t*)rsdp->rsdt;
+    if (!acpi_signature(rsdt->signature, "RSDT", 4) || !acpi_checksum(rsdt, rsdt->length)) return 0;
+
+    const uint32_t *tables = (const uint32_t*)(rsdt + 1);
+    uint32_t entries = (rsdt->length - sizeof(acpi_header_t)) / 4;
+    for (uint32_t i = 0; i < entries; i++) {
+        const acpi_header_t *madt = (const acpi_header_t*)tables[i];
+        if (!acpi_signature(madt->signature, "APIC", 4) || !acpi_checksum(madt, madt->length)) continue;
+
+        /* Entries follow the local APIC address and flags. */
+        const uint8_t *p = (const uint8_t*)(madt + 1) + 8;
+        const uint8_t *end = (const uint8_t*)madt + madt->length;
+        uint32_t count = 0;
+        while (p + 2 <= end && p[1] >= 2 && count < max) {
+            if (p[0] == MADT_LAPIC && p[1] >= 8 && (p[4] & MADT_LAPIC_ENABLED)) ids[count++] = p[3];
+            p += p[1];
+        }
+        return count;
+    }
+    return 0;
+}
+
+/* C entry of an AP, on its idle thread's stack with paging on. */
+static void smp_ap_main(cpu_t *cpu) {
+    int waiting = AP_WAITING;
+    if (!__atomic_compare_exchange_n(&ap_state[cpu->id], &waiting, AP_STARTED, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        for (;;) __asm__ volatile ("cli\nhlt");
+    }
+    smp_load_gdt(cpu);
+    idt_load();
+    sysenter_init();
+    cache_init_ap();
+
+    uint32_t lo, hi;
+    rdmsr(MSR_APIC_BASE, &lo, &hi);
+    wrmsr(MSR_APIC_BASE, lo | 0x800, hi);
+    lapic[LAPIC_SPURIOUS / 4] = 0x100 | SPURIOUS_VECTOR;
+    __asm__ volatile ("fninit");
+
+    cpu->online = 1;
+    sched_cpu_start();
+}
+
+static int smp_start_ap(cpu_t *cpu) {
+    uint32_t stack = sched_add_cpu(cpu->id);
+    if (!stack) return -1;
+
+    tramp_params_t *params = (tramp_params_t*)(SMP_TRAMPOLINE + (tramp_params - smp_trampoline));
+    __asm__ volatile ("mov %%cr0, %0" : "=r"(params->cr0));
+    __asm__ volatile ("mov %%cr3, %0" : "=r"(params->cr3));
+    __asm__ volatile ("mov %%cr4, %0" : "=r"(params->cr4));
+    params->stack = stack;
+    params->entry = (uint32_t)smp_ap_main;
+    params->cpu = (uint32_t)cpu;
+
+    smp_icr(cpu->apic_id, ICR_INIT);
+    smp_delay_us(10000);
+    for (int i = 0; i < 2 && !cpu->online; i++) {
+        smp_icr(cpu->apic_id, ICR_STARTUP | (SMP_TRAMPOLINE >> 12));
+        smp_delay_us(200);
+    }
+
+    uint64_t start = clock_ns();
+    while (!cpu->online && clock_ns() - start < SMP_AP_TIMEOUT_MS * 1000000ULL)
+        __asm__ volatile ("pause");
+    if (cpu->online) return 0;
+
+    /* An AP that got into smp_ap_main in time is let finish. */
+    int waiting = AP_WAITING;
+    if (__atomic_compare_exchange_n(&ap_state[cpu->id], &waiting, AP_ABANDONED, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return -1;
+    while (!cpu->online) __asm__ volatile ("pause");
+    return 0;
+}
+
+/* After sched_init, which the APs' idle threads come from; the start-up
+ * delays need the calibrated TSC. Without an APIC or a MADT the boot CPU
+ * runs alone. */
+void smp_init(void) {
+    uint32_t eax = 1, ebx, ecx, edx;
+    __asm__ volatile ("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+    if (!(edx & (1 << 9)) || !clock_tsc_khz()) return;
+
+    uint8_t ids[SMP_MAX_CPUS * 2];
+    uint32_t found = acpi_madt_cpus(ids, sizeof(ids));
+    if (found < 2) return;
+
+    uint32_t lo, hi;
+    rdmsr(MSR_APIC_BASE, &lo, &hi);
+    wrmsr(MSR_APIC_BASE, lo | 0x800, hi);
+    uintptr_t base = lo & 0xFFFFF000;
+    if (paging_set_flags(base, 0x1000, PG_PCD | PG_PWT, 0) < 0) return;
+    lapic = (volatile uint32_t*)base;
+    lapic[LAPIC_SPURIOUS / 4] = 0x100 | SPURIOUS_VECTOR;
+    cpus[0].apic_id = lapic[LAPIC_ID / 4] >> 24;
+
+    cache_save_boot();
+    mem_copy((void*)SMP_TRAMPOLINE, smp_trampoline, smp_trampoline_end - smp_trampoline);
+    for (uint32_t i = 0; i < found && cpu_count < SMP_MAX_CPUS; i++) {
+        if (ids[i] == cpus[0].apic_id) continue;
+        cpu_t *cpu = &cpus[cpu_count];
+        cpu->self = cpu;
+        cpu->id = cpu_count;
+        cpu->apic_id = ids[i];
+        if (smp_start_ap(cpu) < 0) break;
+        cpu_count++;
+    }
+}
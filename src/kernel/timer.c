@@ -0,0 +1,387 @@
+#include "types.h"
+#include "timer.h"
+#include "sched.h"
+#include "paging.h"
+#include "shell.h"
+
+extern uint64_t clock_ns(void);
+extern uint32_t clock_tsc_khz(void);
+extern uint64_t clock_div(uint64_t n, uint32_t d, uint32_t *rem);
+extern void event_post(uint32_t events);
+
+/* Hierarchical timer wheel with 1 ms ticks: four levels of 64 slots,
+ * each level 64 times coarser than the one below, reaching about 4.6
+ * hours. Arming links the timer into the slot for its expiry and
+ * cancelling unlinks it, both O(1). Whenever the level 0 index wraps, the
+ * current slot of level 1 is cascaded down (and so on upwards).
+ *
+ * The interrupt only advances the wheel and moves due timers to the
+ * expired list. Their callbacks run in a bottom half on the way out of
+ * the interrupt, with interrupts enabled again, so they may re-arm timers
+ * but must not draw; screen work is left to the main loop via EV_TICK.
+ *
+ * With a local APIC the wheel is tickless: only the next tick that has
+ * work (a due slot or a cascade) is programmed, in TSC-deadline mode when
+ * the CPU has it and as an APIC one-shot count otherwise. Without an
+ * APIC the 1 kHz PIT stays on and advances the wheel every tick.
+ *
+ * Any CPU may arm and cancel timers under wheel_lock, but only the boot
+ * CPU's APIC timer drives the wheel and runs callbacks. An AP that arms a
+ * timer due before the programmed deadline sends the boot CPU a timer
+ * IPI, which reprograms it. */
+#define WHEEL_LEVELS 4
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_MAX_DELTA ((1u << (WHEEL_LEVELS * WHEEL_BITS)) - 1)
+#define SLOT_EXPIRED (WHEEL_LEVELS * WHEEL_SLOTS)
+
+#define TIMER_VECTOR 48
+#define SPURIOUS_VECTOR 0xFF
+
+#define MSR_APIC_BASE 0x1B
+#define MSR_TSC_DEADLINE 0x6E0
+
+#define LAPIC_EOI 0x0B0
+#define LAPIC_SPURIOUS 0x0F0
+#define LAPIC_LVT_TIMER 0x320
+#define LAPIC_TIMER_INIT 0x380
+#define LAPIC_TIMER_CURRENT 0x390
+#define LAPIC_TIMER_DIVIDE 0x3E0
+
+#define LVT_MASKED (1 << 16)
+#define LVT_TSC_DEADLINE (2 << 17)
+
+#define TIMER_MODE_PIT 0
+#define TIMER_MODE_ONESHOT 1
+#define TIMER_MODE_DEADLINE 2
+
+static timer_t *wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+static uint64_t occupied[WHEEL_LEVELS];
+static timer_t *expired_list = NULL;
+static uint32_t wheel_tick = 0;
+static int in_bottom_half = 0;
+static spinlock_t wheel_lock = SPINLOCK_INIT;
+
+static volatile uint32_t *lapic = NULL;
+static int mode = TIMER_MODE_PIT;
+static uint32_t apic_khz = 0;
+static uint64_t programmed = ~0ULL;
+static uint32_t pit_ticks = 0;
+static uint32_t interrupts = 0;
+static uint32_t expired = 0;
+
+static inline void wrmsr(uint32_t msr, uint32_t low, uint32_t high) {
+    __asm__ volatile ("wrmsr" : : "c"(msr), "a"(low), "d"(high));
+}
+
+static inline void rdmsr(uint32_t msr, uint32_t *low, uint32_t *high) {
+    __asm__ volatile ("rdmsr" : "=a"(*low), "=d"(*high) : "c"(msr));
+}
+
+/* Milliseconds on the clock_ns time base, or PIT ticks without a TSC. */
+uint32_t timer_ticks(void) {
+    if (!clock_tsc_khz()) return pit_ticks;
+    return (uint32_t)clock_div(clock_ns(), 1000000, NULL);
+}
+
+static void timer_link(timer_t **head, timer_t *t, uint32_t slot) {
+    t->next = *head;
+    if (t->next) t->next->pprev = &t->next;
+    t->pprev = head;
+    t->slot = slot;
+    *head = t;
+}
+
+static void timer_unlink(timer_t *t) {
+    *t->pprev = t->next;
+    if (t->next) t->next->pprev = t->pprev;
+    if (t->slot < SLOT_EXPIRED) {
+        uint32_t level = t->slot / WHEEL_SLOTS, idx = t->slot % WHEEL_SLOTS;
+        if (!wheel[level][idx]) occupied[level] &= ~(1ULL << idx);
+    }
+    t->next = NULL;
+    t->pprev = NULL;
+}
+
+static void timer_insert(timer_t *t) {
+    int32_t delta = (int32_t)(t->expires - wheel_tick);
+    if (delta < 0) t->expires = wheel_tick;
+    else if ((uint32_t)delta > WHEEL_MAX_DELTA) t->expires = wheel_tick + WHEEL_MAX_DELTA;
+
+    uint32_t ahead = t->expires - wheel_tick;
+    uint32_t level = 0;
+    while (level < WHEEL_LEVELS - 1 && ahead >> (WHEEL_BITS * (level + 1))) level++;
+    uint32_t idx = (t->expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+
+    timer_link(&wheel[level][idx], t, level * WHEEL_SLOTS + idx);
+    occupied[level] |= 1ULL << idx;
+}
+
+/* Re-insert the current slot of a level into the levels below; returns
+ * the slot index, so the caller knows whether the next level wraps too. */
+static uint32_t timer_cascade(uint32_t level) {
+    uint32_t idx = (wheel_tick >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    timer_t *t = wheel[level][idx];
+    wheel[level][idx] = NULL;
+    occupied[level] &= ~(1ULL << idx);
+    while (t) {
+        timer_t *next = t->next;
+        timer_insert(t);
+        t = next;
+    }
+    return idx;
+}
+
+/* Process every tick up to now. While level 0 is empty the wheel jumps
+ * straight to the next cascade point, so catching up after a long idle
+ * costs one step per 64 ms. */
+static void HOT_TEXT timer_advance(uint32_t now) {
+    while ((int32_t)(now - wheel_tick) >= 0) {
+        uint32_t idx = wheel_tick & WHEEL_MASK;
+        if (idx == 0) {
+            for (uint32_t level = 1; level < WHEEL_LEVELS; level++) {
+                if (timer_cascade(level) != 0) break;
+            }
+        }
+
+        if (!occupied[0]) {
+            uint32_t boundary = (wheel_tick | WHEEL_MASK) + 1;
+            if ((int32_t)(now - boundary) < 0) {
+                wheel_tick = now + 1;
+                break;
+            }
+            wheel_tick = boundary;
+            continue;
+        }
+
+        timer_t *t = wheel[0][idx];
+        while (t) {
+            timer_t *next = t->next;
+            timer_unlink(t);
+            timer_link(&expired_list, t, SLOT_EXPIRED);
+            t = next;
+        }
+        wheel_tick++;
+    }
+}
+
+/* The first tick with work: the nearest occupied level 0 slot, or the
+ * cascade of the nearest occupied slot of a higher level. A level's
+ * current slot still counts when wheel_tick sits on its cascade point. */
+static int timer_next_tick(uint32_t *tick) {
+    int found = 0;
+    uint32_t best = 0;
+    for (uint32_t level = 0; level < WHEEL_LEVELS; level++) {
+        if (!occupied[level]) continue;
+        uint32_t shift = WHEEL_BITS * level;
+        uint32_t cur = (wheel_tick >> shift) & WHEEL_MASK;
+        uint32_t ahead = (wheel_tick & ((1u << shift) - 1)) ? 1 : 0;
+        while (!((occupied[level] >> ((cur + ahead) & WHEEL_MASK)) & 1)) ahead++;
+
+        uint32_t t = ((wheel_tick >> shift) + ahead) << shift;
+        if (!level) t = wheel_tick + ahead;
+        if (!found || (int32_t)(t - best) < 0) best = t;
+        found = 1;
+    }
+    *tick = best;
+    return found;
+}
+
+/* Deltas past 4 s are clamped; the timer then fires early, finds nothing
+ * due and programs the rest. Boot CPU only, wheel_lock held. */
+static void timer_program(void) {
+    if (mode == TIMER_MODE_PIT) return;
+
+    uint32_t tick;
+    if (!timer_next_tick(&tick)) {
+        programmed = ~0ULL;
+        if (mode == TIMER_MODE_DEADLINE) wrmsr(MSR_TSC_DEADLINE, 0, 0);
+        else lapic[LAPIC_TIMER_INIT / 4] = 0;
+        return;
+    }
+
+    uint64_t deadline = (uint64_t)tick * 1000000;
+    uint64_t now = clock_ns();
+    programmed = deadline;
+    uint64_t delta = deadline > now ? deadline - now : 0;
+    uint32_t delta_ns = delta > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)delta;
+    if (mode == TIMER_MODE_DEADLINE) {
+        uint64_t tsc = rdtsc() + clock_div((uint64_t)delta_ns * clock_tsc_khz(), 1000000, NULL);
+        wrmsr(MSR_TSC_DEADLINE, (uint32_t)tsc, (uint32_t)(tsc >> 32));
+    } else {
+        uint64_t count = clock_div((uint64_t)delta_ns * apic_khz, 1000000, NULL);
+        if (count == 0) count = 1;
+        if (count > 0xFFFFFFFF) count = 0xFFFFFFFF;
+        lapic[LAPIC_TIMER_INIT / 4] = (uint32_t)count;
+    }
+}
+
+void timer_setup(timer_t *t, void (*fn)(void *arg), void *arg) {
+    t->next = NULL;
+    t->pprev = NULL;
+    t->fn = fn;
+    t->arg = arg;
+}
+
+int timer_pending(const timer_t *t) {
+    return t->pprev != NULL;
+}
+
+/* (Re)arm t to fire delay_ms from now, replacing any earlier expiry. The
+ * wheel is brought up to date first, since in tickless mode it only
+ * moves when an interrupt comes. */
+void timer_arm(timer_t *t, uint32_t delay_ms) {
+    uint32_t flags = spin_lock_irqsave(&wheel_lock);
+    uint32_t now = timer_ticks();
+    timer_advance(now);
+    if (t->pprev) timer_unlink(t);
+    t->expires = now + (delay_ms ? delay_ms : 1);
+    timer_insert(t);
+    int kick = 0;
+    if ((uint64_t)t->expires * 1000000 < programmed) {
+        if (smp_cpu_id() == 0) timer_program();
+        else kick = mode != TIMER_MODE_PIT;
+    }
+    spin_unlock_irqrestore(&wheel_lock, flags);
+    if (kick) smp_send_ipi(0, TIMER_VECTOR);
+}
+
+void timer_cancel(timer_t *t) {
+    uint32_t flags = spin_lock_irqsave(&wheel_lock);
+    if (t->pprev) timer_unlink(t);
+    spin_unlock_irqrestore(&wheel_lock, flags);
+}
+
+/* Run expired callbacks with interrupts enabled. Called at the end of a
+ * timer interrupt, after the EOI; a nested timer interrupt only queues
+ * more work for the bottom half that is already running. No thread switch
+ * happens until it is done, even from a nested interrupt. */
+static void timer_bottom_half(void) {
+    if (in_bottom_half || !expired_list) return;
+    in_bottom_half = 1;
+    sched_preempt_disable();
+    for (;;) {
+        void (*fn)(void *arg) = NULL;
+        void *arg = NULL;
+        ticket_lock(&wheel_lock);
+        timer_t *t = expired_list;
+        if (t) {
+            timer_unlink(t);
+            fn = t->fn;
+            arg = t->arg;
+            expired++;
+        }
+        ticket_unlock(&wheel_lock);
+        if (!t) break;
+        /* Once unlinked, the owner may reuse or free t. */
+        __asm__ volatile ("sti");
+        fn(arg);
+        __asm__ volatile ("cli");
+    }
+    in_bottom_half = 0;
+    event_post(EV_TICK);
+    sched_preempt_enable();
+}
+
+/* Called from the PIT interrupt, every millisecond, after the EOI. */
+void HOT_TEXT timer_pit_tick(void) {
+    pit_ticks++;
+    if (mode != TIMER_MODE_PIT) return;
+    interrupts++;
+    ticket_lock(&wheel_lock);
+    timer_advance(timer_ticks());
+    ticket_unlock(&wheel_lock);
+    timer_bottom_half();
+}
+
+/* Local APIC timer interrupt, from lapic_timer_entry; also sent as an IPI
+ * by timer_arm on an AP. */
+void HOT_TEXT timer_lapic_irq(void) {
+    interrupts++;
+    ticket_lock(&wheel_lock);
+    timer_advance(timer_ticks());
+    timer_program();
+    ticket_unlock(&wheel_lock);
+    lapic[LAPIC_EOI / 4] = 0;
+    timer_bottom_half();
+}
+
+/* The APIC timer is counted down for 10 ms of TSC time to find its rate;
+ * this needs a calibrated TSC. */
+static uint32_t timer_lapic_khz(void) {
+    lapic[LAPIC_TIMER_DIVIDE / 4] = 0x3;              /* divide by 16 */
+    lapic[LAPIC_LVT_TIMER / 4] = LVT_MASKED | TIMER_VECTOR;
+    lapic[LAPIC_TIMER_INIT / 4] = 0xFFFFFFFF;
+    uint64_t start = clock_ns();
+    while (clock_ns() - start < 10000000);
+    uint32_t ticks = 0xFFFFFFFF - lapic[LAPIC_TIMER_CURRENT / 4];
+    lapic[LAPIC_TIMER_INIT / 4] = 0;
+    return ticks / 10;
+}
+
+/* Switches to the tickless local APIC timer when there is one. Must run
+ * after clock_init and paging_init; the PIT is masked on success. */
+void timer_init(void) {
+    wheel_tick = timer_ticks();
+
+    uint32_t eax = 1, ebx, ecx, edx;
+    __asm__ volatile ("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+    if (!(edx & (1 << 9)) || !clock_tsc_khz()) return;
+
+    uint32_t lo, hi;
+    rdmsr(MSR_APIC_BASE, &lo, &hi);
+    wrmsr(MSR_APIC_BASE, lo | 0x800, hi);
+    uintptr_t base = lo & 0xFFFFF000;
+    if (paging_set_flags(base, 0x1000, PG_PCD | PG_PWT, 0) < 0) return;
+    lapic = (volatile uint32_t*)base;
+    lapic[LAPIC_SPURIOUS / 4] = 0x100 | SPURIOUS_VECTOR;
+
+    if (ecx & (1 << 24)) {
+        mode = TIMER_MODE_DEADLINE;
+        lapic[LAPIC_LVT_TIMER / 4] = LVT_TSC_DEADLINE | TIMER_VECTOR;
+    } else {
+        apic_khz = timer_lapic_khz();
+        if (!apic_khz) return;
+        mode = TIMER_MODE_ONESHOT;
+        lapic[LAPIC_LVT_TIMER / 4] = TIMER_VECTOR;
+    }
+
+    outb(0x21, inb(0x21) | 0x01);
+    timer_program();
+}
+
+static void timer_print(const char *label, const char *value) {
+    char line[60];
+    shell_strcopy(line, label);
+    shell_strcopy(line + shell_strlen(line), value);
+    shell_println(line, COLOR_FG);
+}
+
+static void timer_print_uint(const char *label, uint32_t val) {
+    char buf[12], tmp[12];
+    int len = 0, pos = 0;
+    do { tmp[len++] = '0' + val % 10; val /= 10; } while (val);
+    while (len) buf[pos++] = tmp[--len];
+    buf[pos] = 0;
+    timer_print(label, buf);
+}
+
+void timer_show_info(void) {
+    static const char *modes[] = {"PIT 1 kHz periodic", "LAPIC one-shot, tickless",
+                                  "LAPIC TSC-deadline, tickless"};
+    uint32_t flags = spin_lock_irqsave(&wheel_lock);
+    uint32_t armed = 0;
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        for (int idx = 0; idx < WHEEL_SLOTS; idx++) {
+            for (timer_t *t = wheel[level][idx]; t; t = t->next) armed++;
+        }
+    }
+    spin_unlock_irqrestore(&wheel_lock, flags);
+
+    timer_print("  Timer:        ", modes[mode]);
+    if (mode == TIMER_MODE_ONESHOT) timer_print_uint("  APIC kHz:     ", apic_khz);
+    timer_print_uint("  Interrupts:   ", interrupts);
+    timer_print_uint("  Expired:      ", expired);
+    timer_print_uint("  Armed:        ", armed);
+}
@@ -1,8 +1,15 @@
 #include "types.h"
+#include "paging.h"
 
 extern void mem_copy(void *dst, const void *src, size_t n);
 extern void mem_set(void *dst, uint8_t val, size_t n);
 
+/* Components live in a demand-zero window: nothing is touched at
+ * preload time, each page is zeroed by the page-fault handler on first
+ * access. Names are looked up through a small open-addressed table. */
+#define XFCE_MAX_COMPONENTS 16
+#define XFCE_HASH_SLOTS 32
+
 typedef struct xfce_component {
     char name[32];
     void *data;
@@ -10,14 +17,51 @@ typedef struct xfce_component {
     int loaded;
 } xfce_component_t;
 
-static xfce_component_t components[16];
+static xfce_component_t components[XFCE_MAX_COMPONENTS];
 static int component_count = 0;
+static int8_t component_hash[XFCE_HASH_SLOTS];
+static int lazy_ready = 0;
 
 static uint8_t *preload_memory = (uint8_t*)XFCE_PRELOAD_BASE;
 static size_t preload_offset = 0;
 
+static uint32_t xfce_hash(const char *name) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; name[i] && i < 31; i++) {
+        h ^= (uint8_t)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static int xfce_name_eq(const char *a, const char *b) {
+    for (int j = 0; j < 32; j++) {
+        if (a[j] != b[j]) return 0;
+        if (a[j] == 0) break;
+    }
+    return 1;
+}
+
+static int xfce_lookup(const char *name) {
+    if (component_count == 0) return -1;
+    uint32_t slot = xfce_hash(name) % XFCE_HASH_SLOTS;
+    for (int i = 0; i < XFCE_HASH_SLOTS; i++) {
+        int idx = component_hash[(slot + i) % XFCE_HASH_SLOTS];
+        if (idx < 0) return -1;
+        if (xfce_name_eq(components[idx].name, name)) return idx;
+    }
+    return -1;
+}
+
 void xfce_register_component(const char *name, size_t size) {
-    if (component_count >= 16) return;
+    if (component_count >= XFCE_MAX_COMPONENTS) return;
+    if (component_count == 0) {
+        for (int i = 0; i < XFCE_HASH_SLOTS; i++) component_hash[i] = -1;
+    }
+    if (xfce_lookup(name) >= 0) return;
+
+    size = (size + 0xFFF) & ~0xFFF;
+    if (preload_offset + size > XFCE_PRELOAD_SIZE) return;
     
     xfce_component_t *comp = &components[component_count];
     
@@ -32,42 +76,32 @@ void xfce_register_component(const char *name, size_t size) {
     comp->size = size;
     comp->loaded = 0;
     
+    uint32_t slot = xfce_hash(comp->name) % XFCE_HASH_SLOTS;
+    while (component_hash[slot] >= 0) slot = (slot + 1) % XFCE_HASH_SLOTS;
+    component_hash[slot] = component_count;
+
     preload_offset += size;
     component_count++;
 }
 
 void xfce_preload_all(void) {
+    if (!lazy_ready) {
+        lazy_ready = paging_demand_zero(XFCE_PRELOAD_BASE, XFCE_PRELOAD_SIZE) == 0;
+    }
+
     for (int i = 0; i < component_count; i++) {
         xfce_component_t *comp = &components[i];
         
-        volatile uint8_t *vdata = (volatile uint8_t*)comp->data;
-        for (size_t j = 0; j < comp->size; j++) {
-            vdata[j] = 0;
-        }
+        if (!lazy_ready) mem_set(comp->data, 0, comp->size);
         
         comp->loaded = 1;
     }
 }
 
 void* xfce_get_component(const char *name) {
-    for (int i = 0; i < component_count; i++) {
-        xfce_component_t *comp = &components[i];
-        
-        int match = 1;
-        for (int j = 0; j < 32; j++) {
-            if (comp->name[j] != name[j]) {
-                match = 0;
-                break;
-            }
-            if (comp->name[j] == 0) break;
-        }
-        
-        if (match && comp->loaded) {
-            return comp->data;
-        }
-    }
-    
-    return NULL;
+    int idx = xfce_lookup(name);
+    if (idx < 0 || !components[idx].loaded) return NULL;
+    return components[idx].data;
 }
 
 void xfce_init(void) {
@@ -84,9 +118,12 @@ void xfce_init(void) {
 }
 
 void xfce_wipe(void) {
-    volatile uint8_t *vmem = (volatile uint8_t*)XFCE_PRELOAD_BASE;
-    for (size_t i = 0; i < XFCE_PRELOAD_SIZE; i++) {
-        vmem[i] = 0;
+    /* Unmapping the window is enough: touched pages are zeroed again on
+     * their next access. */
+    if (lazy_ready) {
+        paging_demand_zero(XFCE_PRELOAD_BASE, XFCE_PRELOAD_SIZE);
+    } else {
+        mem_set((void*)XFCE_PRELOAD_BASE, 0, XFCE_PRELOAD_SIZE);
     }
     
     for (int i = 0; i < component_count; i++) {